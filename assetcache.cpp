@@ -0,0 +1,192 @@
+#include <filesystem>
+#include <string.h>
+#include "assetcache.h"
+#include "mappedfile.h"
+
+namespace {
+// FNV-1a over 8 byte words, only compared between files of the same size
+uint64_t hash_bytes(const char *p, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    const uint64_t prime = 0x100000001b3ull;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * prime;
+    }
+    for (; i < n; i++) h = (h ^ (unsigned char)p[i]) * prime;
+    return h ^ (h >> 32);
+}
+
+long long modified(const std::string &filename) {
+    std::error_code ec;
+    long long mtime = (long long)std::filesystem::last_write_time(filename, ec).time_since_epoch().count();
+    return ec ? 0 : mtime;
+}
+
+// a hash match is only a candidate, sharing the wrong asset would go unnoticed
+bool same_bytes(const std::string &a, const std::string &b) {
+    MappedFile fa, fb;
+    if (!fa.open(a.c_str()) || !fb.open(b.c_str())) return false;
+    return fa.size() == fb.size() && !memcmp(fa.data(), fb.data(), fa.size());
+}
+
+bool hash_file(const std::string &filename, uint64_t &hash) {
+    MappedFile file;
+    if (!file.open(filename.c_str())) return false;
+    hash = hash_bytes(file.data(), file.size());
+    return true;
+}
+}
+
+AssetCache::AssetCache() : paths_(), contents_(), sizes_(), lru_(), budget_(0), used_(0) {}
+
+std::shared_ptr<void> AssetCache::get(const char *kind, const std::string &filename, const std::function<std::shared_ptr<void>(size_t &)> &load) {
+    std::error_code ec;
+    std::string path = std::filesystem::weakly_canonical(filename, ec).string();
+    if (ec) path = filename;
+    // size and modification time tell an edited file from the cached one without reading it
+    uintmax_t size = std::filesystem::file_size(filename, ec);
+    if (ec) size = 0;
+    long long mtime = modified(filename);
+    std::string key = std::string(kind) + ":" + path + "#" + std::to_string(size) + "#" + std::to_string(mtime);
+    std::shared_ptr<slot_t> slot;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::shared_ptr<slot_t> &s = paths_[key];
+        if (!s) s = std::make_shared<slot_t>();
+        slot = s;
+    }
+
+    // the first caller for a path loads it, the others for the same path wait here
+    std::call_once(slot->loaded, [&] {
+        // a file can only have the bytes of a cached one of its size: only then are both
+        // hashed, which is still much cheaper than decoding
+        std::string size_key = std::string(kind) + "#" + std::to_string(size);
+        std::vector<std::shared_ptr<content_t> > same_size;
+        if (size) {
+            std::lock_guard<std::mutex> lock(mtx_);
+            auto range = sizes_.equal_range(size_key);
+            for (auto it = range.first; it != range.second; ++it) same_size.push_back(contents_[it->second->key]);
+        }
+        uint64_t hash = 0;
+        bool hashed = !same_size.empty() && hash_file(filename, hash);
+        for (auto &c : same_size) {
+            if (!hashed) break;
+            uint64_t h = 0;
+            bool ok;
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                ok = c->hashed;
+                h = c->hash;
+            }
+            if (!ok && (modified(c->file) != c->mtime || !hash_file(c->file, h))) continue;
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                c->hash = h;
+                c->hashed = true;
+            }
+            if (h != hash || modified(c->file) != c->mtime || !same_bytes(filename, c->file)) continue;
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (!c->cached) continue;
+            slot->content = c;
+            c->paths.push_back(key);
+            return;
+        }
+        size_t bytes = 0;
+        std::shared_ptr<void> asset = load(bytes);
+        if (!asset) return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        // two names of the same bytes asked for at once may both get here, and are both cached
+        std::shared_ptr<content_t> &c = contents_[key];
+        c = std::make_shared<content_t>();
+        c->asset = asset;
+        c->bytes = bytes;
+        c->key = key;
+        c->size_key = size_key;
+        c->file = filename;
+        c->mtime = mtime;
+        c->hash = hash;
+        c->hashed = hashed;
+        c->cached = true;
+        lru_.push_front(c.get());
+        c->lru = lru_.begin();
+        used_ += bytes;
+        if (size) sizes_.insert(std::make_pair(size_key, c.get()));
+        c->paths.push_back(key);
+        slot->content = c;
+    });
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::shared_ptr<content_t> c = slot->content;
+    if (!c) {
+        // not cached, the next call tries again
+        auto it = paths_.find(key);
+        if (it != paths_.end() && it->second == slot) paths_.erase(it);
+        return NULL;
+    }
+    std::shared_ptr<void> asset = c->asset;     // keeps it from being evicted below
+    if (c->cached) lru_.splice(lru_.begin(), lru_, c->lru);
+    evict();
+    return asset;
+}
+
+void AssetCache::drop(content_t &c) {
+    for (auto &p : c.paths) {
+        auto it = paths_.find(p);
+        if (it != paths_.end() && it->second->content.get() == &c) paths_.erase(it);
+    }
+    auto range = sizes_.equal_range(c.size_key);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second != &c) continue;
+        sizes_.erase(it);
+        break;
+    }
+    lru_.erase(c.lru);
+    used_ -= c.bytes;
+    c.cached = false;
+    std::string key = c.key;
+    contents_.erase(key);       // last, it may own c
+}
+
+// oldest first, assets still in use can't free anything and are skipped
+void AssetCache::evict() {
+    if (!budget_) return;
+    for (auto it = lru_.end(); used_ > budget_ && it != lru_.begin();) {
+        content_t *c = *--it;
+        if (c->asset.use_count() > 1) continue;
+        it = std::next(it);
+        drop(*c);
+    }
+}
+
+void AssetCache::set_budget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    budget_ = bytes;
+    evict();
+}
+
+size_t AssetCache::budget() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return budget_;
+}
+
+size_t AssetCache::used() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return used_;
+}
+
+void AssetCache::clear() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (auto &c : contents_) c.second->cached = false;
+    paths_.clear();
+    contents_.clear();
+    sizes_.clear();
+    lru_.clear();
+    used_ = 0;
+}
+
+AssetCache &AssetCache::instance() {
+    static AssetCache cache;
+    return cache;
+}
@@ -0,0 +1,70 @@
+#ifndef __ASSETCACHE_H__
+#define __ASSETCACHE_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <cstdint>
+#include <typeinfo>
+
+// process wide store of loaded meshes and textures, handed out as shared handles. An asset
+// is found by its path, size and modification time, or else by a hash of its file, so a file
+// loaded under two names and two files with the same bytes are both loaded once. Files are
+// only hashed when one of the same kind and size is cached already, and compared byte for
+// byte when the hashes match.
+// Over the memory budget, the least recently used assets that no handle points to any more
+// are dropped.
+class AssetCache {
+private:
+    struct content_t {
+        std::shared_ptr<void> asset;
+        size_t bytes;
+        std::string key;                // in contents_: the key of the path it was loaded from
+        std::string size_key;           // in sizes_: kind and file size
+        std::string file;               // it was loaded from
+        long long mtime;                // of file when it was loaded, it is not hashed once it changed
+        uint64_t hash;                  // of file, once hashed is set
+        bool hashed;
+        std::vector<std::string> paths; // keys in paths_ that resolved to it
+        std::list<content_t *>::iterator lru;
+        bool cached;                    // false once evicted
+    };
+    struct slot_t {
+        std::once_flag loaded;
+        std::shared_ptr<content_t> content;     // NULL when the load failed
+    };
+    std::mutex mtx_;
+    std::unordered_map<std::string, std::shared_ptr<slot_t> > paths_;
+    std::unordered_map<std::string, std::shared_ptr<content_t> > contents_;
+    std::unordered_multimap<std::string, content_t *> sizes_;   // candidates for the same bytes
+    std::list<content_t *> lru_;    // most recently used first
+    size_t budget_;
+    size_t used_;
+
+    std::shared_ptr<void> get(const char *kind, const std::string &filename, const std::function<std::shared_ptr<void>(size_t &)> &load);
+    void drop(content_t &c);
+    void evict();
+public:
+    AssetCache();
+    // load(filename) the first time the file is asked for, the cached asset after that.
+    // T::bytes() gives the memory an asset takes, a NULL from load is not cached.
+    template <typename T>
+    std::shared_ptr<T> get(const std::string &filename, const std::function<std::shared_ptr<T>(const std::string &)> &load) {
+        return std::static_pointer_cast<T>(get(typeid(T).name(), filename, [&](size_t &bytes) -> std::shared_ptr<void> {
+            std::shared_ptr<T> asset = load(filename);
+            bytes = asset ? asset->bytes() : 0;
+            return asset;
+        }));
+    }
+    void set_budget(size_t bytes);  // 0, the default, for no limit
+    size_t budget();
+    size_t used();                  // by the cached assets, in bytes
+    void clear();                   // forgets every asset, handles already out stay valid
+    static AssetCache &instance();
+};
+
+#endif //__ASSETCACHE_H__
@@ -0,0 +1,257 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+
+#include "geometry.h"
+#include "model.h"
+#include "assetcache.h"
+#include "render.h"
+#include "framewriter.h"
+#include "threadpool.h"
+
+#ifndef SMALLRASTERIZER_ASSETS
+#define SMALLRASTERIZER_ASSETS "asset"
+#endif
+
+typedef std::chrono::steady_clock clock_type;
+
+double ms_since(clock_type::time_point t0) {
+	return std::chrono::duration<double, std::milli>(clock_type::now() - t0).count();
+}
+
+// the bundled models, by the name -models takes
+struct asset_t {
+	const char *name;
+	const char *file;	// under the asset directory
+};
+const asset_t assets[] = {
+	{"african_head", "african_head.obj"},
+	{"diablo3_pose", "diablo3_pose.obj"},
+	{"spot", "spot.obj"},
+	{"horse", "horse/horse.obj"},
+	{"cerberus", "gun/Cerberus.obj"},
+};
+
+// what one row of the report measures, in milliseconds per repetition
+enum stage_t { OBJ, TEX, VERTEX, BIN, RASTER, SHADE, OUTPUT, TOTAL, NSTAGES };
+const char *const stage_names[NSTAGES] = {"obj", "tex", "vertex", "bin", "raster", "shade", "output", "total"};
+
+struct row_t {
+	std::string model, shader;
+	int width, height;
+	std::vector<double> ms[NSTAGES];	// one per repetition
+};
+
+double median(std::vector<double> v) {
+	if (v.empty()) return 0.;
+	std::sort(v.begin(), v.end());
+	size_t n = v.size();
+	return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) * 0.5;
+}
+
+double minimum(const std::vector<double> &v) {
+	return v.empty() ? 0. : *std::min_element(v.begin(), v.end());
+}
+
+std::vector<std::string> split(const std::string &s) {
+	std::vector<std::string> items;
+	std::istringstream in(s);
+	std::string item;
+	while (std::getline(in, item, ','))
+		if (!item.empty()) items.push_back(item);
+	return items;
+}
+
+// the camera looks at the model, turned by angle, from far enough that its bounding sphere
+// fills most of the vertical field of view, whatever the scale of the model
+view_t frame_model(Model &obj, const view_t &defaults) {
+	view_t v = defaults;
+	float r = std::max(obj.bound_radius(), 1e-3f);
+	v.target = turn(obj.bound_center(), Vec3f(0, 0, 0), v.angle);
+	float dist = r / std::sin(22.5f / 180.f * (float)M_PI) * 1.1f;
+	v.camera = v.target + Vec3f(1, 0, 4).normalize() * dist;
+	v.light = v.target + Vec3f(-5, 10, 5).normalize() * dist;
+	return v;
+}
+
+void print_table(const std::vector<row_t> &rows, int reps, FILE *out) {
+	fprintf(out, "median of %d runs in ms on %d threads (min of total in brackets), vertex/bin/raster include the shadow pass\n",
+			reps, ThreadPool::instance().size());
+	fprintf(out, "%-13s %-14s %-10s", "model", "shader", "size");
+	for (int s = 0; s < NSTAGES; s++) fprintf(out, " %9s", stage_names[s]);
+	fprintf(out, "\n");
+	for (auto &row : rows) {
+		char size[32];
+		snprintf(size, sizeof(size), "%dx%d", row.width, row.height);
+		fprintf(out, "%-13s %-14s %-10s", row.model.c_str(), row.shader.c_str(), size);
+		for (int s = 0; s < NSTAGES; s++) fprintf(out, " %9.2f", median(row.ms[s]));
+		fprintf(out, " (%.2f)\n", minimum(row.ms[TOTAL]));
+	}
+}
+
+// one line per model, shader and size: medians and minima of every stage
+void print_csv(const std::vector<row_t> &rows, int reps, FILE *out) {
+	fprintf(out, "model,shader,width,height,reps");
+	for (int s = 0; s < NSTAGES; s++) fprintf(out, ",%s_ms,%s_min_ms", stage_names[s], stage_names[s]);
+	fprintf(out, "\n");
+	for (auto &row : rows) {
+		fprintf(out, "%s,%s,%d,%d,%d", row.model.c_str(), row.shader.c_str(), row.width, row.height, reps);
+		for (int s = 0; s < NSTAGES; s++) fprintf(out, ",%.3f,%.3f", median(row.ms[s]), minimum(row.ms[s]));
+		fprintf(out, "\n");
+	}
+}
+
+// smallRasterizer_bench [-reps n] [-warmup n] [-sizes 512,1024,...] [-models name,...] [-shaders name,...]
+//                       [-forward] [-noshadows] [-msaa 2|4|8] [-color rgba8|rgb10|rgb32f] [-depth 32f|24|16]
+//                       [-meshcache] [-budget MB] [-assets dir] [-images dir] [-csv] [-o file]
+// renders every bundled model with every shader at every size and reports the time of each
+// stage: OBJ parse (or with -meshcache the binary mesh cache) and texture reads from a cold
+// asset cache, then per image the vertex stage, binning, rasterization, deferred shading and
+// encoding the image as PPM, in memory or with -images written to that directory (with
+// -forward shading is part of rasterization). Every measurement is taken warmup times
+// unrecorded, then reps times, and the median is reported, as a table or with -csv one
+// comma separated line per image.
+int main(int argc, char *argv[])
+{
+	int reps = 5, warmup = 1;
+	std::vector<int> sizes = {512, 1024, 2048};
+	std::vector<std::string> models, shaders(std::begin(shader_names), std::end(shader_names));
+	for (auto &a : assets) models.push_back(a.name);
+	bool deferred = true, csv = false, mesh_cache = false, formats = true;
+	std::string asset_dir = SMALLRASTERIZER_ASSETS, image_dir, output;
+	view_t defaults = {Vec3f(1, 0, 4), Vec3f(-5, 10, 5), Vec3f(0, 0, 0), 135.f, true, 1, Framebuffer::RGBA8, Framebuffer::D32F};
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-reps") && i + 1 < argc) reps = std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-warmup") && i + 1 < argc) warmup = std::max(0, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-sizes") && i + 1 < argc) {
+			sizes.clear();
+			for (auto &s : split(argv[++i])) sizes.push_back(std::max(1, atoi(s.c_str())));
+		}
+		else if (!strcmp(argv[i], "-models") && i + 1 < argc) models = split(argv[++i]);
+		else if (!strcmp(argv[i], "-shaders") && i + 1 < argc) shaders = split(argv[++i]);
+		else if (!strcmp(argv[i], "-forward")) deferred = false;
+		else if (!strcmp(argv[i], "-noshadows")) defaults.shadows = false;
+		else if (!strcmp(argv[i], "-msaa") && i + 1 < argc) defaults.samples = std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-color") && i + 1 < argc) formats = formats && parse_color(argv[++i], defaults.color);
+		else if (!strcmp(argv[i], "-depth") && i + 1 < argc) formats = formats && parse_depth(argv[++i], defaults.depth);
+		else if (!strcmp(argv[i], "-meshcache")) mesh_cache = true;
+		else if (!strcmp(argv[i], "-budget") && i + 1 < argc) AssetCache::instance().set_budget((size_t)std::max(0L, atol(argv[++i])) << 20);
+		else if (!strcmp(argv[i], "-assets") && i + 1 < argc) asset_dir = argv[++i];
+		else if (!strcmp(argv[i], "-images") && i + 1 < argc) image_dir = argv[++i];
+		else if (!strcmp(argv[i], "-csv")) csv = true;
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc) output = argv[++i];
+		else {
+			std::cerr << "usage: " << argv[0] << " [-reps n] [-warmup n] [-sizes 512,1024,...] [-models name,...] [-shaders name,...]"
+					  << " [-forward] [-noshadows] [-msaa 2|4|8] [-color rgba8|rgb10|rgb32f] [-depth 32f|24|16]"
+					  << " [-meshcache] [-budget MB] [-assets dir] [-images dir] [-csv] [-o file]" << std::endl;
+			return 1;
+		}
+	}
+	if (!formats) {
+		std::cerr << "-color takes rgba8, rgb10 or rgb32f, -depth 32f, 24 or 16" << std::endl;
+		return 1;
+	}
+	std::vector<const asset_t*> picked;
+	for (auto &name : models) {
+		const asset_t *a = NULL;
+		for (auto &b : assets)
+			if (name == b.name) a = &b;
+		if (!a) {
+			std::cerr << "unknown model " << name << ", the models are african_head, diablo3_pose, spot, horse and cerberus" << std::endl;
+			return 1;
+		}
+		picked.push_back(a);
+	}
+	for (auto &name : shaders) {
+		if (!with_shader(name, [](Shader &) {})) {
+			std::cerr << "unknown shader " << name << std::endl;
+			return 1;
+		}
+	}
+	FILE *out = stdout;
+	if (!output.empty() && !(out = fopen(output.c_str(), "w"))) {
+		std::cerr << "can't open " << output << std::endl;
+		return 1;
+	}
+
+	std::vector<row_t> rows;
+	FrameWriter writer(1);
+	for (auto a : picked) {
+		std::string file = asset_dir + "/" + a->file;
+		// every load starts from an empty cache, so mesh and maps are read from disk each time
+		std::unique_ptr<Model> obj;
+		std::vector<double> obj_ms, tex_ms;
+		for (int i = 0; i < warmup + reps; i++) {
+			obj.reset();
+			AssetCache::instance().clear();
+			clock_type::time_point t0 = clock_type::now();
+			obj.reset(new Model(file.c_str(), mesh_cache, true /*lazy_textures*/));
+			double t_obj = ms_since(t0);
+			t0 = clock_type::now();
+			obj->load_textures();
+			double t_tex = ms_since(t0);
+			if (i < warmup) continue;
+			obj_ms.push_back(t_obj);
+			tex_ms.push_back(t_tex);
+		}
+		if (!obj->nfaces()) {
+			std::cerr << "can't load model " << file << std::endl;
+			return 1;
+		}
+		std::vector<Model*> objs(1, obj.get());
+		view_t v = frame_model(*obj, defaults);
+
+		for (int size : sizes) {
+			Rasterizer rasterizer(size, size);
+			rasterizer.deferred = deferred;
+			Framebuffer frame(size, size, v.color, v.depth);
+			Framebuffer shadowmap(size, size, Framebuffer::NO_COLOR);
+			for (auto &name : shaders) {
+				row_t row;
+				row.model = a->name;
+				row.shader = name;
+				row.width = row.height = size;
+				row.ms[OBJ] = obj_ms;
+				row.ms[TEX] = tex_ms;
+				char image[256];
+				snprintf(image, sizeof(image), "%s/bench_%s_%s_%d.ppm", image_dir.c_str(), a->name, name.c_str(), size);
+				std::vector<unsigned char> encoded;
+				for (int i = 0; i < warmup + reps; i++) {
+					rasterizer.timings = Rasterizer::timings_t();
+					clock_type::time_point t0 = clock_type::now();
+					with_shader(name, [&](auto &shader) {
+						render(shader, objs, v, rasterizer, frame, shadowmap);
+					});
+					clock_type::time_point t1 = clock_type::now();
+					if (image_dir.empty()) writer.encode(frame, FrameWriter::PPM, encoded);
+					else {
+						writer.write(image, frame);
+						writer.flush();
+					}
+					double t_output = ms_since(t1), t_total = ms_since(t0);
+					if (i < warmup) continue;
+					row.ms[VERTEX].push_back(rasterizer.timings.vertex);
+					row.ms[BIN].push_back(rasterizer.timings.bin);
+					row.ms[RASTER].push_back(rasterizer.timings.raster);
+					row.ms[SHADE].push_back(rasterizer.timings.shade);
+					row.ms[OUTPUT].push_back(t_output);
+					row.ms[TOTAL].push_back(t_total);
+				}
+				rows.push_back(row);
+				if (!csv) fprintf(stderr, "%s %s %d: %.2f ms\n", a->name, name.c_str(), size, median(row.ms[TOTAL]));
+			}
+		}
+	}
+
+	if (csv) print_csv(rows, reps, out);
+	else print_table(rows, reps, out);
+	if (out != stdout) fclose(out);
+	return 0;
+}
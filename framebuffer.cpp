@@ -0,0 +1,89 @@
+#include <string.h>
+#include <algorithm>
+#include "framebuffer.h"
+
+const int Framebuffer::TILE;
+
+namespace {
+// v holds n elements when used, and no memory otherwise
+template <class T>
+void fit(std::vector<T> &v, bool used, size_t n) {
+    if (used) v.resize(n);
+    else std::vector<T>().swap(v);
+}
+}
+
+Framebuffer::Framebuffer(int w, int h, ColorFormat color, DepthFormat depth) : width_(w), height_(h), color_format_(color), depth_format_(depth),
+    tiles_x_((w + TILE - 1) / TILE), tiles_y_((h + TILE - 1) / TILE), cleared_() {
+    allocate();
+    clear();
+}
+
+void Framebuffer::allocate() {
+    size_t n = (size_t)width_ * height_;
+    fit(rgb_, color_format_ == RGB32F, n);
+    fit(packed_, color_format_ == RGBA8 || color_format_ == RGB10A2, n);
+    fit(zf_, depth_format_ == D32F, n);
+    fit(z16_, depth_format_ == D16, n);
+    fit(z24_, depth_format_ == D24, n * 3);
+}
+
+void Framebuffer::set_formats(ColorFormat color, DepthFormat depth) {
+    if (color == color_format_ && depth == depth_format_) return;
+    color_format_ = color;
+    depth_format_ = depth;
+    allocate();
+}
+
+void Framebuffer::clear(Vec3f color) {
+    clear_color_ = color;
+    cleared_.assign((size_t)tiles_x_ * tiles_y_, 1);
+}
+
+void Framebuffer::fill_color(int tx, int ty, int w, int h, ColorFormat color, Vec3f value, Vec3f *rgb, uint32_t *packed) {
+    int x0 = tx * TILE, x1 = std::min(x0 + TILE, w);
+    int y0 = ty * TILE, y1 = std::min(y0 + TILE, h);
+    uint32_t p = color == RGBA8 || color == RGB10A2 ? pack(value, color) : 0;
+    for (int y = y0; y < y1; y++) {
+        size_t row = (size_t)y * w;
+        if (color == RGB32F) std::fill(rgb + row + x0, rgb + row + x1, value);
+        else if (color != NO_COLOR) std::fill(packed + row + x0, packed + row + x1, p);
+    }
+}
+
+void Framebuffer::fill_tile(int tx, int ty) {
+    fill_color(tx, ty, width_, height_, color_format_, clear_color_, rgb_.data(), packed_.data());
+    int x0 = tx * TILE, x1 = std::min(x0 + TILE, width_);
+    int y0 = ty * TILE, y1 = std::min(y0 + TILE, height_);
+    for (int y = y0; y < y1; y++) {
+        size_t row = (size_t)y * width_;
+        // fixed point depth is 0 at infinity
+        if (depth_format_ == D32F) std::fill(zf_.begin() + row + x0, zf_.begin() + row + x1, clear_depth());
+        else if (depth_format_ == D16) std::fill(z16_.begin() + row + x0, z16_.begin() + row + x1, 0);
+        else memset(&z24_[(row + x0) * 3], 0, (size_t)(x1 - x0) * 3);
+    }
+    cleared_[tx + ty * tiles_x_] = 0;
+}
+
+void Framebuffer::fill_cleared() {
+    for (int ty = 0; ty < tiles_y_; ty++)
+        for (int tx = 0; tx < tiles_x_; tx++) prepare(tx, ty);
+}
+
+void Framebuffer::fill_tiles(const std::vector<unsigned char> &cleared, Vec3f color, ColorFormat format, int w, int h, Vec3f *rgb, uint32_t *packed) {
+    int tiles_x = (w + TILE - 1) / TILE, tiles_y = (h + TILE - 1) / TILE;
+    if (cleared.size() < (size_t)tiles_x * tiles_y) return;
+    for (int ty = 0; ty < tiles_y; ty++)
+        for (int tx = 0; tx < tiles_x; tx++)
+            if (cleared[tx + ty * tiles_x]) fill_color(tx, ty, w, h, format, color, rgb, packed);
+}
+
+size_t Framebuffer::bytes() const {
+    return rgb_.size() * sizeof(Vec3f) + packed_.size() * sizeof(uint32_t) + zf_.size() * sizeof(float) + z16_.size() * sizeof(uint16_t) + z24_.size();
+}
+
+void Framebuffer::swap_color(std::vector<Vec3f> &rgb, std::vector<uint32_t> &packed) {
+    rgb_.swap(rgb);
+    packed_.swap(packed);
+    allocate();
+}
@@ -0,0 +1,147 @@
+#ifndef __FRAMEBUFFER_H__
+#define __FRAMEBUFFER_H__
+
+#include <stdint.h>
+#include <vector>
+#include <limits>
+#include "geometry.h"
+#include "simd.h"
+
+// color and depth of w x h pixels, top row first, that a Rasterizer draws into. Colors are
+// [0, 255] per channel whatever the format, depth is larger = closer in every format.
+// clear() only marks the TILE x TILE tiles, each one gets the clear values when it is first
+// drawn to (prepare()) or when the frame is written out.
+class Framebuffer {
+public:
+    static const int TILE = 8;
+
+    enum ColorFormat {
+        RGB32F,     // Vec3f, as the shaders return it
+        RGBA8,      // 8 bit per channel, R in the low byte, clamped and truncated like FrameWriter::to_rgb8()
+        RGB10A2,    // 10 bit per channel, R in the low bits, rounded
+        NO_COLOR    // depth only, e.g. a shadow map
+    };
+    enum DepthFormat {
+        D32F,       // float as the rasterizer computes it: view space z for perspective draws, screen z for affine ones
+        D24,        // reversed fixed point in 3 bytes, see Rasterizer::draw()
+        D16         // the same in 2 bytes
+    };
+private:
+    int width_, height_;
+    ColorFormat color_format_;
+    DepthFormat depth_format_;
+    std::vector<Vec3f> rgb_;        // RGB32F
+    std::vector<uint32_t> packed_;  // RGBA8, RGB10A2
+    std::vector<float> zf_;         // D32F
+    std::vector<uint16_t> z16_;     // D16
+    std::vector<unsigned char> z24_;    // D24, little endian
+    int tiles_x_, tiles_y_;
+    std::vector<unsigned char> cleared_;    // per tile, still waiting for the clear values
+    Vec3f clear_color_;
+
+    void allocate();
+    void fill_tile(int tx, int ty);
+    static void fill_color(int tx, int ty, int w, int h, ColorFormat color, Vec3f value, Vec3f *rgb, uint32_t *packed);
+public:
+    Framebuffer(int w, int h, ColorFormat color = RGB32F, DepthFormat depth = D32F);
+    int width() const { return width_; }
+    int height() const { return height_; }
+    ColorFormat color_format() const { return color_format_; }
+    DepthFormat depth_format() const { return depth_format_; }
+    // reallocates what changes, the pixels are undefined until the next clear() then
+    void set_formats(ColorFormat color, DepthFormat depth);
+    // every pixel to color and the farthest depth, in O(tiles)
+    void clear(Vec3f color = Vec3f(0, 0, 0));
+    Vec3f clear_color() const { return clear_color_; }
+    float clear_depth() const { return depth_format_ == D32F ? -std::numeric_limits<float>::max() : 0.f; }
+    bool cleared(int tx, int ty) const { return cleared_[tx + ty * tiles_x_] != 0; }
+    const std::vector<unsigned char> &cleared_tiles() const { return cleared_; }
+    // gives tile (tx, ty) the clear values if it still waits for them, before it is drawn to.
+    // Threads may prepare different tiles at once.
+    void prepare(int tx, int ty) {
+        if (cleared_[tx + ty * tiles_x_]) fill_tile(tx, ty);
+    }
+    // prepares every tile, for code that reads the buffers below directly
+    void fill_cleared();
+    // sets the tiles flagged in cleared to color, in rgb or packed by the format: for a color
+    // buffer handed over by swap_color() along with cleared_tiles()
+    static void fill_tiles(const std::vector<unsigned char> &cleared, Vec3f color, ColorFormat format, int w, int h, Vec3f *rgb, uint32_t *packed);
+    // of the color and depth buffers
+    size_t bytes() const;
+
+    // the buffers as they are, tiles still cleared included, NULL when the format is another one
+    float *depth_f32() { return zf_.empty() ? NULL : zf_.data(); }
+    const float *depth_f32() const { return zf_.empty() ? NULL : zf_.data(); }
+    const Vec3f *color_f32() const { return rgb_.empty() ? NULL : rgb_.data(); }
+    const uint32_t *color_packed() const { return packed_.empty() ? NULL : packed_.data(); }
+    // hands the color buffer over in rgb or packed, by the format, and takes the buffers in
+    // them in its place, resized to fit. The color is undefined until the next clear() then.
+    void swap_color(std::vector<Vec3f> &rgb, std::vector<uint32_t> &packed);
+
+    // fixed point depth is tested as the integer it is stored as, in [0, depth_range()].
+    // 0 for D32F, which takes the depth as it comes.
+    float depth_range() const {
+        return depth_format_ == D16 ? 65535.f : depth_format_ == D24 ? 16777215.f : 0.f;
+    }
+    // z rounded to what depth() reads back once it is stored, so that the depth test sees
+    // the same value a later one compares against
+    vfloat quantize(const vfloat &z) const {
+        if (depth_format_ == D32F) return z;
+        // NaN goes to 0: max returns its second operand when one is NaN
+        return vmin(vtrunc(vmax(z, vfloat(0.f)) + vfloat(0.5f)), vfloat(depth_range()));
+    }
+    float quantize(float z) const {
+        if (depth_format_ == D32F) return z;
+        z = z > 0.f ? (float)(int)(z + 0.5f) : 0.f;
+        return z < depth_range() ? z : depth_range();
+    }
+    float depth(size_t i) const {
+        if (depth_format_ == D32F) return zf_[i];
+        if (depth_format_ == D16) return (float)z16_[i];
+        const unsigned char *p = &z24_[i * 3];
+        return (float)(p[0] | p[1] << 8 | p[2] << 16);
+    }
+    // z from quantize()
+    void set_depth(size_t i, float z) {
+        if (depth_format_ == D32F) {
+            zf_[i] = z;
+        } else if (depth_format_ == D16) {
+            z16_[i] = (uint16_t)z;
+        } else {
+            uint32_t q = (uint32_t)z;
+            unsigned char *p = &z24_[i * 3];
+            p[0] = (unsigned char)q;
+            p[1] = (unsigned char)(q >> 8);
+            p[2] = (unsigned char)(q >> 16);
+        }
+    }
+
+    // c as a pixel of a packed format, RGBA8 or RGB10A2
+    static uint32_t pack(Vec3f c, ColorFormat format) {
+        float ch[3] = {c.x, c.y, c.z};
+        uint32_t p = 0;
+        for (int i = 0; i < 3; i++) {
+            float x = ch[i] > 0.f ? ch[i] : 0.f;
+            x = x < 255.f ? x : 255.f;
+            p |= format == RGBA8 ? (uint32_t)x << (8 * i) : (uint32_t)(x * (1023.f / 255.f) + 0.5f) << (10 * i);
+        }
+        return p | (format == RGBA8 ? 0xff000000u : 0xc0000000u);
+    }
+    static Vec3f unpack(uint32_t p, ColorFormat format) {
+        if (format == RGBA8) return Vec3f((float)(p & 0xff), (float)(p >> 8 & 0xff), (float)(p >> 16 & 0xff));
+        const float s = 255.f / 1023.f;
+        return Vec3f((p & 0x3ff) * s, (p >> 10 & 0x3ff) * s, (p >> 20 & 0x3ff) * s);
+    }
+    Vec3f color(size_t i) const {
+        if (color_format_ == RGB32F) return rgb_[i];
+        if (color_format_ == NO_COLOR) return Vec3f(0, 0, 0);
+        return unpack(packed_[i], color_format_);
+    }
+    // the shader output stage: c goes to the buffer in its format
+    void set_color(size_t i, Vec3f c) {
+        if (color_format_ == RGB32F) rgb_[i] = c;
+        else if (color_format_ != NO_COLOR) packed_[i] = pack(c, color_format_);
+    }
+};
+
+#endif //__FRAMEBUFFER_H__
@@ -0,0 +1,212 @@
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "framewriter.h"
+#include "tgaimage.h"
+#include "simd.h"
+
+FrameWriter::Format FrameWriter::format_of(const std::string &filename) {
+    size_t dot = filename.find_last_of(".");
+    std::string ext = dot == std::string::npos ? "" : filename.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)tolower(c); });
+    if (ext == "pfm") return PFM;
+    if (ext == "tga") return TGA;
+    return PPM;
+}
+
+// Vec3f is three packed floats, so the frame is converted as one flat array
+void FrameWriter::to_rgb8(const Vec3f *frame, int n, unsigned char *out) {
+    const float *in = &frame[0].x;
+    size_t count = (size_t)n * 3, i = 0;
+    const vfloat lo(0.f), hi(255.f);
+    // NaN goes to 0: max returns its second operand when one is NaN
+    for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+        store_u8(vmin(vmax(vfloat::load(in + i), lo), hi), out + i);
+    for (; i < count; i++) {
+        float x = in[i] > 0.f ? in[i] : 0.f;
+        out[i] = (unsigned char)(int)(x < 255.f ? x : 255.f);
+    }
+}
+
+void FrameWriter::to_rgb8(const uint32_t *pixels, int n, Framebuffer::ColorFormat color, unsigned char *out) {
+    for (int i = 0; i < n; i++, out += 3) {
+        uint32_t p = pixels[i];
+        if (color == Framebuffer::RGBA8) {
+            out[0] = (unsigned char)p;
+            out[1] = (unsigned char)(p >> 8);
+            out[2] = (unsigned char)(p >> 16);
+        } else {
+            for (int c = 0; c < 3; c++) out[c] = (unsigned char)(((p >> (10 * c) & 0x3ff) * 255 + 511) / 1023);
+        }
+    }
+}
+
+FrameWriter::FrameWriter(int max_pending) : queue_(), spare_(), nbuffers_(0), max_pending_(std::max(1, max_pending)), busy_(false), stop_(false) {
+    thread_ = std::thread(&FrameWriter::run, this);
+}
+
+FrameWriter::~FrameWriter() {
+    flush();
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    thread_.join();
+}
+
+// a spare buffer, or a new one while fewer than max_pending are out
+FrameWriter::pixels_t FrameWriter::take_buffer(std::unique_lock<std::mutex> &lock) {
+    done_.wait(lock, [this] { return !spare_.empty() || nbuffers_ < max_pending_; });
+    pixels_t buffer;
+    if (spare_.empty()) {
+        nbuffers_++;
+    } else {
+        buffer = std::move(spare_.back());
+        spare_.pop_back();
+    }
+    return buffer;
+}
+
+void FrameWriter::push(job_t &job, std::unique_lock<std::mutex> &lock) {
+    done_.wait(lock, [this] { return (int)queue_.size() < max_pending_; });
+    queue_.push_back(std::move(job));
+    wake_.notify_one();
+}
+
+void FrameWriter::write(const std::string &filename, Framebuffer &fb) {
+    write(filename, fb, format_of(filename));
+}
+
+// the color buffer of fb into job, for a spare one
+void FrameWriter::take_frame(job_t &job, Framebuffer &fb) {
+    job.width = fb.width();
+    job.height = fb.height();
+    std::unique_lock<std::mutex> lock(mtx_);
+    job.frame = take_buffer(lock);
+    lock.unlock();
+    job.frame.color = fb.color_format();
+    job.frame.cleared = fb.cleared_tiles();
+    job.frame.clear_color = fb.clear_color();
+    fb.swap_color(job.frame.rgb, job.frame.packed);
+}
+
+void FrameWriter::write(const std::string &filename, Framebuffer &fb, Format format) {
+    job_t job;
+    job.filename = filename;
+    job.format = format;
+    take_frame(job, fb);
+    std::unique_lock<std::mutex> lock(mtx_);
+    push(job, lock);
+}
+
+bool FrameWriter::encode(Framebuffer &fb, Format format, std::vector<unsigned char> &bytes) {
+    job_t job;
+    job.format = format;
+    take_frame(job, fb);
+    bool ok = encode(job, bytes);
+    std::lock_guard<std::mutex> lock(mtx_);
+    spare_.push_back(std::move(job.frame));
+    done_.notify_all();
+    return ok;
+}
+
+void FrameWriter::flush() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    done_.wait(lock, [this] { return queue_.empty() && !busy_; });
+}
+
+void FrameWriter::run() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    for (;;) {
+        wake_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (queue_.empty()) return;     // stopping
+        job_t job = std::move(queue_.front());
+        queue_.pop_front();
+        busy_ = true;
+        done_.notify_all();             // room in the queue
+        lock.unlock();
+        if (!save(job)) std::cerr << "can't write " + job.filename + "\n";
+        lock.lock();
+        spare_.push_back(std::move(job.frame));
+        busy_ = false;
+        done_.notify_all();
+    }
+}
+
+// tiles nothing was drawn to are only now set to the clear color, false without a color buffer
+bool FrameWriter::fill(job_t &job) {
+    int w = job.width, h = job.height;
+    pixels_t &frame = job.frame;
+    bool rgb = frame.color == Framebuffer::RGB32F;
+    if ((rgb ? frame.rgb.size() : frame.packed.size()) < (size_t)w * h) return false;     // e.g. NO_COLOR
+    Framebuffer::fill_tiles(frame.cleared, frame.clear_color, frame.color, w, h, frame.rgb.data(), frame.packed.data());
+    return true;
+}
+
+// header and pixels of a PFM or PPM file, converted in one pass
+bool FrameWriter::encode(job_t &job, std::vector<unsigned char> &bytes) {
+    if (job.format == TGA || !fill(job)) return false;
+    int w = job.width, h = job.height;
+    const pixels_t &frame = job.frame;
+    bool rgb = frame.color == Framebuffer::RGB32F;
+    char header[64];
+    if (job.format == PFM) {
+        // a negative scale means little endian, which is what we write on x86 and ARM
+        int n = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", w, h);
+        bytes.resize(n + (size_t)w * h * 3 * sizeof(float));
+        memcpy(bytes.data(), header, n);
+        // bottom row first, as the format wants
+        std::vector<float> dst((size_t)w * 3);
+        for (int y = 0; y < h; y++) {
+            size_t row = (size_t)(h - 1 - y) * w;
+            if (rgb) {
+                const float *src = &frame.rgb[row].x;
+                for (int i = 0; i < w * 3; i++) dst[i] = src[i] / 255.f;
+            } else {
+                for (int x = 0; x < w; x++) {
+                    Vec3f c = Framebuffer::unpack(frame.packed[row + x], frame.color) / 255.f;
+                    dst[x * 3] = c.x;
+                    dst[x * 3 + 1] = c.y;
+                    dst[x * 3 + 2] = c.z;
+                }
+            }
+            memcpy(bytes.data() + n + (size_t)y * w * 3 * sizeof(float), dst.data(), dst.size() * sizeof(float));
+        }
+        return true;
+    }
+    int n = snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", w, h, 255);
+    bytes.resize(n + (size_t)w * h * 3);
+    memcpy(bytes.data(), header, n);
+    if (rgb) to_rgb8(frame.rgb.data(), w * h, bytes.data() + n);
+    else to_rgb8(frame.packed.data(), w * h, frame.color, bytes.data() + n);
+    return true;
+}
+
+// PFM and PPM in one write of their encoded bytes
+bool FrameWriter::save(job_t &job) {
+    if (job.format != TGA) {
+        std::vector<unsigned char> bytes;
+        if (!encode(job, bytes)) return false;
+        FILE *f = fopen(job.filename.c_str(), "wb");
+        if (!f) return false;
+        bool ok = fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+        return fclose(f) == 0 && ok;
+    }
+    if (!fill(job)) return false;
+    int w = job.width, h = job.height;
+    const pixels_t &frame = job.frame;
+    std::vector<unsigned char> rgb8((size_t)w * h * 3);
+    if (frame.color == Framebuffer::RGB32F) to_rgb8(frame.rgb.data(), w * h, rgb8.data());
+    else to_rgb8(frame.packed.data(), w * h, frame.color, rgb8.data());
+    TGAImage img(w, h, TGAImage::RGB);
+    unsigned char *p = img.buffer();
+    const unsigned char *q = rgb8.data();
+    for (size_t i = 0, n = (size_t)w * h; i < n; i++, p += 3, q += 3) {
+        p[0] = q[2];
+        p[1] = q[1];
+        p[2] = q[0];
+    }
+    return img.write_tga_file(job.filename.c_str(), false);
+}
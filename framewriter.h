@@ -0,0 +1,80 @@
+#ifndef __FRAMEWRITER_H__
+#define __FRAMEWRITER_H__
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "geometry.h"
+#include "framebuffer.h"
+
+// saves rendered frames from a background thread, so the next frame can be rendered while
+// the last one goes to disk. Frames are the color buffers of Framebuffers.
+class FrameWriter {
+public:
+    enum Format {
+        PPM,    // binary P6
+        PFM,    // float RGB, scaled to [0, 1]
+        TGA     // uncompressed, through TGAImage
+    };
+    // by the extension of filename, PPM when it is none of .pfm and .tga
+    static Format format_of(const std::string &filename);
+    // frame to 8 bit RGB, clamped and truncated
+    static void to_rgb8(const Vec3f *frame, int n, unsigned char *out);
+    // packed RGBA8 or RGB10A2 pixels to 8 bit RGB
+    static void to_rgb8(const uint32_t *pixels, int n, Framebuffer::ColorFormat color, unsigned char *out);
+private:
+    // a frame in rgb when it is RGB32F, in packed otherwise. The tiles flagged in cleared
+    // are left to be filled with clear_color, see Framebuffer::clear().
+    struct pixels_t {
+        Framebuffer::ColorFormat color;
+        std::vector<Vec3f> rgb;
+        std::vector<uint32_t> packed;
+        std::vector<unsigned char> cleared;
+        Vec3f clear_color;
+    };
+    struct job_t {
+        std::string filename;
+        Format format;
+        int width, height;
+        pixels_t frame;             // converted on the writer thread
+    };
+    std::thread thread_;
+    std::mutex mtx_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::deque<job_t> queue_;
+    std::vector<pixels_t> spare_;   // frame buffers of saved jobs, for reuse
+    int nbuffers_;      // frame buffers handed out, queued, being saved or spare
+    int max_pending_;
+    bool busy_;
+    bool stop_;
+
+    pixels_t take_buffer(std::unique_lock<std::mutex> &lock);
+    void take_frame(job_t &job, Framebuffer &fb);
+    void push(job_t &job, std::unique_lock<std::mutex> &lock);
+    static bool fill(job_t &job);
+    static bool encode(job_t &job, std::vector<unsigned char> &bytes);
+    static bool save(job_t &job);
+    void run();
+public:
+    // at most max_pending frames wait for the disk or are being written, write() blocks until
+    // one is done otherwise
+    FrameWriter(int max_pending = 2);
+    ~FrameWriter();     // flush()es
+    // takes over the color buffer of fb without a copy, in its format, and leaves in it the
+    // buffer of an earlier saved frame (or a new one) to render the next frame into: with
+    // max_pending 1, two buffers take turns between the renderer and the disk. A packed
+    // buffer is a third of the size of a Vec3f one and is written without converting floats.
+    void write(const std::string &filename, Framebuffer &fb);
+    void write(const std::string &filename, Framebuffer &fb, Format format);
+    // the PPM or PFM file write() would save for fb, into bytes on the calling thread instead
+    // of to disk. fb gets a spare buffer back the same way. False for TGA.
+    bool encode(Framebuffer &fb, Format format, std::vector<unsigned char> &bytes);
+    // waits until everything queued so far is on disk
+    void flush();
+};
+
+#endif //__FRAMEWRITER_H__
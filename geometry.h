@@ -2,6 +2,7 @@
 #define VEC3_H
 
 #include <cmath>
+#include <cstdint>
 
 template<typename T>
 class Vec2 {
@@ -92,6 +93,15 @@ public:
     Vec4() : x(0), y(0), z(0), w(1) {}
     Vec4(T x_, T y_, T z_, T w_) : x(x_), y(y_), z(z_), w(w_) {}
 
+    Vec4 operator + (const Vec4 &v) const {
+        return Vec4(x + v.x, y + v.y, z + v.z, w + v.w);
+    }
+    Vec4 operator - (const Vec4 &v) const {
+        return Vec4(x - v.x, y - v.y, z - v.z, w - v.w);
+    }
+    Vec4 operator * (const T &a) const {
+        return Vec4(x * a, y * a, z * a, w * a);
+    }
     T operator [] (uint8_t i) {
         return i <= 0? x : (i == 1? y : (i == 2? z : w));
     }
@@ -1,163 +1,273 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <stdio.h>
+#include <string.h>
 #include <limits>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <algorithm>
 
 #include "geometry.h"
 #include "model.h"
+#include "assetcache.h"
 #include "tgaimage.h"
-#include "shader.h"
-#include "transform.h"
-#include "pbrShader.h"
-#include "shadowShader.h"
+#include "render.h"
+#include "framewriter.h"
+#include "threadpool.h"
 
 const int w = 512;
 const int h = 512;
 
-int clamp(float x) {
-	x = x < 0.f? 0.f : x > 255.f? 255.f : x;
-	return static_cast<int>(x);
+// 8 bit color unless the image keeps floats
+Framebuffer::ColorFormat default_color(const std::string &output) {
+	return FrameWriter::format_of(output) == FrameWriter::PFM ? Framebuffer::RGB32F : Framebuffer::RGBA8;
 }
 
-Vec3f correction_gamma(Vec3f c) {
-	/*c.x = pow(c.x, 1.0 / 2.0);
-	c.y = pow(c.y, 1.0 / 2.0);
-	c.z = pow(c.z, 1.0 / 2.0);*/
-	return c;
+// name_0012.ext for frame 12 of a sequence
+std::string frame_name(const std::string &name, int i) {
+	char num[16];
+	snprintf(num, sizeof(num), "_%04d", i);
+	size_t dot = name.find_last_of(".");
+	if (dot == std::string::npos) return name + num;
+	return name.substr(0, dot) + num + name.substr(dot);
 }
 
-void writePPM(char* filename, Vec3f *c) {
-	FILE *f = fopen(filename, "w");
-    fprintf(f, "P3\n%d %d\n%d\n", w, h, 255);
-    for (int i = 0; i < w * h; ++i) 
-		fprintf(f, "%d %d %d ", clamp(c[i].x), clamp(c[i].y), clamp(c[i].z));
-}
+// one line of a job list
+struct job_t {
+	std::string model;
+	std::string shader;
+	std::string output;
+	view_t view;
+	double ms;		// to render it
+	Model *obj;		// while its round of run_batch() runs
+};
 
-bool backCulling(Vec3f v0, Vec3f v1, Vec3f v2) {
-	//Vec3f v01 = v1 - v0;
-	//Vec3f v02 = v2 - v0;
-	//Vec3f view(0, 0, 1);
-	//Vec3f normal = cross(v01, v02);
-	//return dot(normal, view) > 0;
-	
-	//return 1;
-
-	float signed_area = v0.x * v1.y - v0.y * v1.x +
-						v1.x * v2.y - v1.y * v2.x +
-						v2.x * v0.y - v2.y * v0.x;   //|AB AC|
-	return signed_area <= 0;
+bool parse_vec3(const std::string &s, Vec3f &v) {
+	return sscanf(s.c_str(), "%f,%f,%f", &v.x, &v.y, &v.z) == 3;
 }
 
-Vec3f barycentric(Vec2f v0, Vec2f v1, Vec2f v2, Vec2f p) {
-	return Vec3f((p-v1).cross(v2-v1), (p-v2).cross(v0-v2), (p-v0).cross(v1-v0)) * (1.f / (v2-v0).cross(v1-v0));
+// one job per line, as key=value pairs: model=<obj> (needed), shader=<name>, camera=x,y,z,
+// light=x,y,z, target=x,y,z, angle=<degrees>, shadows=0|1, msaa=1|2|4|8, color=rgba8|rgb10|rgb32f,
+// depth=32f|24|16, out=<file>. What is left out is taken from defaults, out from the line number,
+// color by out when defaults has none. Empty lines and lines starting with # are skipped.
+bool read_jobs(const char *filename, const view_t &defaults, std::vector<job_t> &jobs) {
+	std::ifstream in(filename);
+	if (!in.is_open()) {
+		std::cerr << "can't open job list " << filename << std::endl;
+		return false;
+	}
+	std::string line;
+	for (int nline = 1; std::getline(in, line); nline++) {
+		std::istringstream tokens(line);
+		std::string token;
+		if (!(tokens >> token) || token[0] == '#') continue;
+		job_t job;
+		job.shader = "bump";
+		job.view = defaults;
+		job.ms = 0.;
+		job.obj = NULL;
+		char out[32];
+		snprintf(out, sizeof(out), "job_%04d.ppm", nline);
+		job.output = out;
+		bool color = false;
+		do {
+			size_t eq = token.find('=');
+			std::string key = token.substr(0, eq), value = eq == std::string::npos ? "" : token.substr(eq + 1);
+			bool ok = !value.empty();
+			if (key == "model") job.model = value;
+			else if (key == "shader") job.shader = value;
+			else if (key == "out") job.output = value;
+			else if (key == "camera") ok = ok && parse_vec3(value, job.view.camera);
+			else if (key == "light") ok = ok && parse_vec3(value, job.view.light);
+			else if (key == "target") ok = ok && parse_vec3(value, job.view.target);
+			else if (key == "angle") ok = ok && sscanf(value.c_str(), "%f", &job.view.angle) == 1;
+			else if (key == "msaa") ok = ok && sscanf(value.c_str(), "%d", &job.view.samples) == 1;
+			else if (key == "color") ok = color = parse_color(value, job.view.color);
+			else if (key == "depth") ok = parse_depth(value, job.view.depth);
+			else if (key == "shadows") {
+				ok = value == "0" || value == "1";
+				job.view.shadows = value == "1";
+			}
+			else ok = false;
+			if (!ok) {
+				std::cerr << filename << ":" << nline << ": can't read " << token << std::endl;
+				return false;
+			}
+		} while (tokens >> token);
+		if (!color && defaults.color == Framebuffer::NO_COLOR) job.view.color = default_color(job.output);
+		if (job.model.empty() || !with_shader(job.shader, [](Shader &) {})) {
+			std::cerr << filename << ":" << nline << ": needs model= and a known shader=" << std::endl;
+			return false;
+		}
+		jobs.push_back(job);
+	}
+	return true;
 }
 
-void triangle(Vec4f *v, Shader &shader, Vec3f *&frame, float *&zbuffer) {
-	Vec3f v0 = proj3(v[0]);
-	Vec3f v1 = proj3(v[1]);
-	Vec3f v2 = proj3(v[2]);
-	//std::cout << v0.x << ";" << v0.y << ";" << v0.z << std::endl;
-	// bounding box
-	float bboxmin_x = std::max(0.f, std::min(v0.x, std::min(v1.x, v2.x)));
-	float bboxmax_x = std::min(w - 1.f, std::max(v0.x, std::max(v1.x, v2.x)));
-	float bboxmin_y = std::max(0.f, std::min(v0.y, std::min(v1.y, v2.y)));
-	float bboxmax_y = std::min(h - 1.f, std::max(v0.y, std::max(v1.y, v2.y)));
-
-    Vec3f color;
-	for (int x = bboxmin_x; x <= bboxmax_x; x++)
-		for (int y = bboxmin_y; y <= bboxmax_y; y++) {
-			Vec2f p(x + 0.5, y + 0.5);	// pixel center
-			Vec3f bc = barycentric(Vec2f(v0.x, v0.y), Vec2f(v1.x, v1.y), Vec2f(v2.x, v2.y), p);
-			//Vec3f bar = bc;
-			// perspective correction
-			bc.x /= v[0].w;	// w save z in world space
-			bc.y /= v[1].w;
-			bc.z /= v[2].w;
-			float z = 1.f / (bc.x + bc.y + bc.z);
-			bc.x *= z;
-			bc.y *= z;
-			bc.z *= z;
-            if (bc.x < 0 || bc.y < 0 || bc.z < 0) continue;
-            color = correction_gamma(shader.fragment(bc)) * 255.f;
-			//std::cout << color.x << ";" << color.y << ";" << color.z << std::endl;
-			if (z > zbuffer[x + y * w]) {
-				zbuffer[x + y * w] = z;
-				frame[x + y * w] = color;
+// renders every job of the list. The jobs, sorted by model, run in rounds of whole models
+// with at least one job per thread: the models of a round are loaded before it and freed
+// after it, so only those are held at once and -budget can drop the rest from the cache.
+// Within a round the jobs are spread over the threads with work stealing: every thread draws
+// whole images with a single threaded rasterizer of its own, so no frame waits on another one.
+int run_batch(const char *filename, const view_t &defaults) {
+	typedef std::chrono::steady_clock clock;
+	clock::time_point start = clock::now();
+	std::vector<job_t> jobs;
+	if (!read_jobs(filename, defaults, jobs)) return 1;
+
+	std::vector<int> order(jobs.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = (int)i;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return jobs[a].model < jobs[b].model; });
+
+	struct renderer_t {
+		ThreadPool pool;
+		Rasterizer rasterizer;
+		Framebuffer frame;
+		Framebuffer shadowmap;
+		renderer_t() : pool(1), rasterizer(w, h, 32, &pool), frame(w, h), shadowmap(w, h, Framebuffer::NO_COLOR) {
+			rasterizer.deferred = true;
+		}
+	};
+	ThreadPool &pool = ThreadPool::instance();
+	std::vector<std::unique_ptr<renderer_t> > renderers(pool.size());
+	FrameWriter writer(pool.size());
+	double load_ms = 0.;
+	int nmodels = 0;
+	for (size_t begin = 0, end; begin < order.size(); begin = end) {
+		end = begin;
+		while (end < order.size() && (end - begin < (size_t)pool.size() || jobs[order[end]].model == jobs[order[end - 1]].model)) end++;
+		// loaded here, as a model parses on the pool the jobs run on
+		clock::time_point loading = clock::now();
+		std::map<std::string, std::unique_ptr<Model> > models;
+		for (size_t k = begin; k < end; k++) {
+			job_t &job = jobs[order[k]];
+			std::unique_ptr<Model> &obj = models[job.model];
+			if (!obj) {
+				obj.reset(new Model(job.model.c_str()));
+				if (!obj->nfaces()) {
+					std::cerr << "can't load model " << job.model << std::endl;
+					return 1;
+				}
+				nmodels++;
 			}
+			job.obj = obj.get();
 		}
-}
+		load_ms += std::chrono::duration<double, std::milli>(clock::now() - loading).count();
 
+		pool.parallel_for_stealing((int)(end - begin), [&](int i, int thread) {
+			job_t &job = jobs[order[begin + i]];
+			std::unique_ptr<renderer_t> &r = renderers[thread];
+			if (!r) r.reset(new renderer_t());
+			clock::time_point t0 = clock::now();
+			std::vector<Model*> objs(1, job.obj);
+			with_shader(job.shader, [&](auto &shader) {
+				render(shader, objs, job.view, r->rasterizer, r->frame, r->shadowmap);
+			});
+			job.ms = std::chrono::duration<double, std::milli>(clock::now() - t0).count();
+			writer.write(job.output, r->frame);
+		});
+		for (size_t k = begin; k < end; k++) jobs[order[k]].obj = NULL;
+	}
+	writer.flush();
+	double total_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
 
+	double sum = 0.;
+	for (auto &job : jobs) {
+		printf("%8.2f ms  %-8s %s -> %s\n", job.ms, job.shader.c_str(), job.model.c_str(), job.output.c_str());
+		sum += job.ms;
+	}
+	printf("%d jobs, %d models loaded in %.1f ms, %.1f ms rendering on %d threads, %.1f ms wall\n",
+		   (int)jobs.size(), nmodels, load_ms, sum, pool.size(), total_ms);
+	return 0;
+}
+
+// smallRasterizer [-frames n] [-spin model|camera|light] [-o file] [-noshadows] [-msaa 2|4|8]
+//                 [-color rgba8|rgb10|rgb32f] [-depth 32f|24|16] [-budget MB]
+// renders one image, or with -frames a turntable of n images: the model (or the camera, or
+// the light) turns a full circle around the y axis over the sequence. Models, buffers and
+// the rasterizer are set up once, and each image is written while the next one renders.
+// Colors are 8 bit unless the output is .pfm, depth is float. -budget caps the memory of the
+// meshes and textures that are loaded but no longer in use, see AssetCache.
+// smallRasterizer -batch <job list> [-budget MB]
+// renders the jobs of the list, see read_jobs()
 int main(int argc, char *argv[])
 {
     //Model *obj = new Model("D:/Documents/vision/course/smallRasterizer/obj/xier/xierbody.obj");
+	int nframes = 0;
+	std::string spin = "model";
+	std::string output;
+	const char *batch = NULL;
+	bool shadows = true;
+	int samples = 1;
+	Framebuffer::ColorFormat color = Framebuffer::NO_COLOR;	// by the output
+	Framebuffer::DepthFormat depth = Framebuffer::D32F;
+	bool formats = true;
+	long budget = 0;	// MB, 0 for no limit
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-frames") && i + 1 < argc) nframes = std::max(0, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-spin") && i + 1 < argc) spin = argv[++i];
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc) output = argv[++i];
+		else if (!strcmp(argv[i], "-batch") && i + 1 < argc) batch = argv[++i];
+		else if (!strcmp(argv[i], "-noshadows")) shadows = false;
+		else if (!strcmp(argv[i], "-msaa") && i + 1 < argc) samples = std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-color") && i + 1 < argc) formats = formats && parse_color(argv[++i], color);
+		else if (!strcmp(argv[i], "-depth") && i + 1 < argc) formats = formats && parse_depth(argv[++i], depth);
+		else if (!strcmp(argv[i], "-budget") && i + 1 < argc) budget = std::max(0L, atol(argv[++i]));
+		else {
+			std::cerr << "usage: " << argv[0] << " [-frames n] [-spin model|camera|light] [-o file] [-noshadows] [-msaa 2|4|8]"
+					  << " [-color rgba8|rgb10|rgb32f] [-depth 32f|24|16] [-budget MB] | -batch <job list> [-budget MB]" << std::endl;
+			return 1;
+		}
+	}
+	if (!formats) {
+		std::cerr << "-color takes rgba8, rgb10 or rgb32f, -depth 32f, 24 or 16" << std::endl;
+		return 1;
+	}
+	if (spin != "model" && spin != "camera" && spin != "light") {
+		std::cerr << "-spin takes model, camera or light" << std::endl;
+		return 1;
+	}
+	if (output.empty()) output = nframes ? "frame.ppm" : "image.ppm";
+	AssetCache::instance().set_budget((size_t)budget << 20);
 
 	const Vec3f camera(1, 0, 400);	// camera position
 	Vec3f light(-5, 10, 5);
 	Vec3f target(0, 0, 0);
-
-	float fov = 45;
-	float aspect = 1;
-	float near = -0.1, far = -50;
 	float angle = 135.f;// 180.f
-	Vec3f up(0, 1, 0);
-	
-	Matrix4f m_projection = projection(fov, aspect, near, far);
-	Matrix4f m_viewport = viewport(w, h);
-	Matrix4f m_view = view(camera, up, target);
-    Matrix4f m_model = model(angle);
-	Matrix4f mvp = m_projection * m_view * m_model;
-
-	Matrix4f m_view_light = view(light, up, target);
-	Matrix4f m_ortho_projection = ortho_projection(-2, 2, -2, 2, near, far);
-	Matrix4f lightmvp = m_ortho_projection * m_view_light * m_model;
+	view_t defaults = {camera, light, target, angle, shadows, samples, color, depth};
+	if (batch) return run_batch(batch, defaults);
+	if (defaults.color == Framebuffer::NO_COLOR) defaults.color = default_color(output);
 
 	bump_shader shader;
 	//pbr_shader shader;
-	shader.payload.mvp = mvp;
-	shader.payload.m_model = m_model;
-	shader.payload.m_viewport = m_viewport;
 	//shader.payload.obj = obj;
-	shader.payload.m_view = m_view;
-	shader.payload.lightmvp = lightmvp;
-
-	shader.payload.light = light;
-	shader.payload.target = target;
-	shader.payload.camera = camera;
-
-	Vec3f* frame = new Vec3f[w * h];
-	//Vec3f* depth = new Vec3f[w * h];
-	float* zbuffer = new float[w * h];
-	for (int i = 0; i < w * h; i++) zbuffer[i] = -std::numeric_limits<float>::max();
-
-    /*for (int i = 0; i < obj->nfaces(); i++) {
-        Vec4f v[3];
-        for (int j = 0; j < 3; j++) {
-            v[j] = shader.vertex(i, j);
-        }
-        triangle(v, shader, frame, zbuffer);
-    }*/
+
+	// the renderer draws into frame while the writer holds the color buffer of the one before
+	Framebuffer frame(w, h, defaults.color, defaults.depth);
+	Framebuffer shadowmap(w, h, Framebuffer::NO_COLOR);
 
 	std::vector<Model*> objs;
 	objs.push_back(new Model("D:/Documents/vision/course/smallRasterizer/asset/horse/horse.obj"));
-	int cnt = 0;
-	for (auto obj : objs) {
-		shader.payload.obj = obj;
-		for (int i = 0; i < obj->nfaces(); i++) {
-			Vec4f v[3];
-			for (int j = 0; j < 3; j++) {
-				v[j] = shader.vertex(i, j);
-			}
-			//if (!backCulling(shader.payload.ndcCoord[0], shader.payload.ndcCoord[1], shader.payload.ndcCoord[2])) {
-				triangle(v, shader, frame, zbuffer);
-				//cnt++;
-			//}
-		}
-	}
-	std::cout << cnt << std::endl;
+	Rasterizer rasterizer(w, h);
+	rasterizer.deferred = true;	// bump and pbr are expensive, shade each pixel once
+	FrameWriter writer(1);
 
-    writePPM(static_cast<char*>("image.ppm"), frame);	// origin at the left top
+	for (int i = 0; i < std::max(1, nframes); i++) {
+		float turned = nframes ? 360.f * i / nframes : 0.f;
+		view_t v = defaults;
+		if (spin == "camera") v.camera = turn(camera, target, turned);
+		if (spin == "light") v.light = turn(light, target, turned);
+		if (spin == "model") v.angle = angle + turned;
+		render(shader, objs, v, rasterizer, frame, shadowmap);
+		// origin at the left top, .pfm and .tga work too. frame gets the color buffer of an
+		// earlier image back, render() clears it.
+		writer.write(nframes ? frame_name(output, i) : output, frame);
+	}
+	writer.flush();
 
 	//delete[] depth;
-	delete[] frame;
-	delete[] zbuffer;
-}
\ No newline at end of file
+}
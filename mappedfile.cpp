@@ -0,0 +1,104 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char empty_file[1] = {0};
+
+#ifdef _WIN32
+
+MappedFile::MappedFile() : data_(NULL), size_(0), file_(INVALID_HANDLE_VALUE), mapping_(NULL) {}
+
+bool MappedFile::open(const char *filename) {
+    close();
+    file_ = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file_ == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size)) {
+        close();
+        return false;
+    }
+    size_ = (size_t)size.QuadPart;
+    if (!size_) {
+        data_ = empty_file;
+        return true;
+    }
+    mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping_) data_ = (const char *)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (!data_) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_ && data_ != empty_file) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+    data_ = NULL;
+    size_ = 0;
+    mapping_ = NULL;
+    file_ = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+MappedFile::MappedFile() : data_(NULL), size_(0), fd_(-1) {}
+
+bool MappedFile::open(const char *filename) {
+    close();
+    fd_ = ::open(filename, O_RDONLY);
+    if (fd_ < 0) return false;
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        close();
+        return false;
+    }
+    size_ = (size_t)st.st_size;
+    if (!size_) {
+        data_ = empty_file;
+        return true;
+    }
+    void *p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (p == MAP_FAILED) {
+        close();
+        return false;
+    }
+    madvise(p, size_, MADV_SEQUENTIAL);
+    data_ = (const char *)p;
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_ && data_ != empty_file) munmap((void *)data_, size_);
+    if (fd_ >= 0) ::close(fd_);
+    data_ = NULL;
+    size_ = 0;
+    fd_ = -1;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::is_open() {
+    return data_ != NULL;
+}
+
+const char *MappedFile::data() {
+    return data_;
+}
+
+size_t MappedFile::size() {
+    return size_;
+}
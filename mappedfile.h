@@ -0,0 +1,30 @@
+#ifndef __MAPPEDFILE_H__
+#define __MAPPEDFILE_H__
+
+#include <cstddef>
+
+// read-only memory mapping of a whole file
+class MappedFile {
+private:
+    const char *data_;
+    size_t size_;
+#ifdef _WIN32
+    void *file_;
+    void *mapping_;
+#else
+    int fd_;
+#endif
+
+    MappedFile(const MappedFile &);
+    MappedFile &operator =(const MappedFile &);
+public:
+    MappedFile();
+    ~MappedFile();
+    bool open(const char *filename);
+    void close();
+    bool is_open();
+    const char *data();
+    size_t size();
+};
+
+#endif //__MAPPEDFILE_H__
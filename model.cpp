@@ -1,118 +1,556 @@
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <cmath>
+#include <algorithm>
+#include <filesystem>
+#include <string.h>
+#include <unordered_map>
+#include <future>
 #include "model.h"
+#include "mappedfile.h"
+#include "threadpool.h"
+#include "assetcache.h"
 
-Model::Model(const char *filename) : verts_(), faces_(), norms_(), uv_(), diffusemap_(), roughnessmap_(), metalnessmap_() { //, diffusemap_(), normalmap_(), specularmap_()
-    std::ifstream in;
-    in.open (filename, std::ifstream::in);
-    if (in.fail()) return;
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
-        char trash;
-        if (!line.compare(0, 2, "v ")) {
-            iss >> trash;
+namespace {
+struct obj_index {
+    int v, vt, vn;  // 0-based, vt/vn are -1 when the face doesn't give them
+    bool operator==(const obj_index &o) const { return v == o.v && vt == o.vt && vn == o.vn; }
+};
+struct obj_index_hash {
+    size_t operator()(const obj_index &i) const {
+        return ((size_t)i.v * 73856093u) ^ ((size_t)i.vt * 19349663u) ^ ((size_t)i.vn * 83492791u);
+    }
+};
+
+// what one thread parsed out of its slice of the file
+struct obj_chunk {
+    std::vector<Vec3f> verts;
+    std::vector<Vec3f> norms;
+    std::vector<Vec2f> uvs;
+    std::vector<obj_index> corners;
+    std::vector<unsigned char> relative;    // per corner, bit k: index k counts from the start of the chunk
+    std::vector<int> face_sizes;
+};
+
+inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char *skip_space(const char *p, const char *end) {
+    while (p < end && is_space(*p)) p++;
+    return p;
+}
+
+const double pow10_table[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                              1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+double pow10i(int e) {
+    if (e >= 0 && e <= 22) return pow10_table[e];
+    if (e < 0 && e >= -22) return 1. / pow10_table[-e];
+    return std::pow(10., e);
+}
+
+// returns NULL when there is no number at p
+const char *parse_float(const char *p, const char *end, float &out) {
+    p = skip_space(p, end);
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+    unsigned long long mantissa = 0;
+    int exponent = 0, digits = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+        if (mantissa < 100000000000000000ull) mantissa = mantissa * 10 + (*p - '0');
+        else exponent++;
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+            if (mantissa < 100000000000000000ull) {
+                mantissa = mantissa * 10 + (*p - '0');
+                exponent--;
+            }
+        }
+    }
+    if (!digits) return NULL;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool eneg = false;
+        if (q < end && (*q == '-' || *q == '+')) eneg = *q++ == '-';
+        if (q < end && *q >= '0' && *q <= '9') {
+            int e = 0;
+            for (; q < end && *q >= '0' && *q <= '9'; q++)
+                if (e < 10000) e = e * 10 + (*q - '0');
+            exponent += eneg ? -e : e;
+            p = q;
+        }
+    }
+    double v = exponent < 0 ? (double)mantissa / pow10i(-exponent) : (double)mantissa * pow10i(exponent);
+    out = (float)(neg ? -v : v);
+    return p;
+}
+
+const char *parse_int(const char *p, const char *end, int &out) {
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+    if (p >= end || *p < '0' || *p > '9') return NULL;
+    int v = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) v = v * 10 + (*p - '0');
+    out = neg ? -v : v;
+    return p;
+}
+
+// OBJ indices start at 1, negative ones count back from the last element read so far
+inline void resolve_index(int raw, int count, int &idx, unsigned char &relative, int bit) {
+    if (raw > 0) {
+        idx = raw - 1;
+    } else if (raw < 0) {
+        idx = count + raw;
+        relative |= 1 << bit;
+    } else {
+        idx = -1;
+    }
+}
+
+void parse_chunk(const char *p, const char *end, obj_chunk &c) {
+    while (p < end) {
+        const char *eol = p;
+        while (eol < end && *eol != '\n') eol++;
+        p = skip_space(p, eol);
+        if (eol - p > 2 && p[0] == 'v' && is_space(p[1])) {
             Vec3f v;
-            // for (int i=0;i<3;i++) iss >> v[i];
-            iss >> v.x >> v.y >> v.z;
-            verts_.push_back(v);
-        } else if (!line.compare(0, 3, "vn ")) {
-            iss >> trash >> trash;
+            const char *q = parse_float(p + 2, eol, v.x);
+            if (q) q = parse_float(q, eol, v.y);
+            if (q) q = parse_float(q, eol, v.z);
+            c.verts.push_back(v);
+        } else if (eol - p > 3 && p[0] == 'v' && p[1] == 'n' && is_space(p[2])) {
             Vec3f n;
-            // for (int i=0;i<3;i++) iss >> n[i];
-            iss >> n.x >> n.y >> n.z;
-            norms_.push_back(n);
-        } else if (!line.compare(0, 3, "vt ")) {
-            iss >> trash >> trash;
+            const char *q = parse_float(p + 3, eol, n.x);
+            if (q) q = parse_float(q, eol, n.y);
+            if (q) q = parse_float(q, eol, n.z);
+            c.norms.push_back(n);
+        } else if (eol - p > 3 && p[0] == 'v' && p[1] == 't' && is_space(p[2])) {
             Vec2f uv;
-            // for (int i=0;i<2;i++) iss >> uv[i];
-            iss >> uv.x >> uv.y;
-            uv_.push_back(uv);
-        }  else if (!line.compare(0, 2, "f ")) {
-            std::vector<Vec3i> f;
-            Vec3i tmp;
-            iss >> trash;
-            while (iss >> tmp.x >> trash >> tmp.y >> trash >> tmp.z) {
-                // for (int i=0; i<3; i++) tmp[i]--; // in wavefront obj all indices start at 1, not zero
-                tmp.x--; tmp.y--; tmp.z--;
-                f.push_back(tmp);
+            const char *q = parse_float(p + 3, eol, uv.x);
+            if (q) q = parse_float(q, eol, uv.y);
+            c.uvs.push_back(uv);
+        } else if (eol - p > 2 && p[0] == 'f' && is_space(p[1])) {
+            // v, v/vt, v//vn or v/vt/vn
+            int n = 0;
+            const char *q = p + 2;
+            for (;;) {
+                q = skip_space(q, eol);
+                int raw[3] = {0, 0, 0};
+                q = parse_int(q, eol, raw[0]);
+                if (!q) break;
+                for (int k = 1; k < 3 && q < eol && *q == '/'; k++) {
+                    q++;
+                    const char *r = parse_int(q, eol, raw[k]);
+                    if (r) q = r;
+                }
+                obj_index idx;
+                unsigned char relative = 0;
+                resolve_index(raw[0], (int)c.verts.size(), idx.v, relative, 0);
+                resolve_index(raw[1], (int)c.uvs.size(), idx.vt, relative, 1);
+                resolve_index(raw[2], (int)c.norms.size(), idx.vn, relative, 2);
+                c.corners.push_back(idx);
+                c.relative.push_back(relative);
+                n++;
+            }
+            c.face_sizes.push_back(n);
+        }
+        p = eol + 1;
+    }
+}
+}
+
+// the file is mapped and cut into chunks at line boundaries, the chunks are parsed in
+// parallel and then stitched together, shifting chunk-relative indices by what came before
+bool mesh_t::load_obj(const char *filename) {
+    MappedFile file;
+    if (!file.open(filename)) return false;
+    const char *begin = file.data(), *end = begin + file.size();
+
+    const size_t min_chunk = 1 << 16;
+    ThreadPool &pool = ThreadPool::instance();
+    int nchunks = (int)std::max<size_t>(1, std::min<size_t>(pool.size() * 4, file.size() / min_chunk));
+    std::vector<const char *> cuts(nchunks + 1, end);
+    cuts[0] = begin;
+    for (int i = 1; i < nchunks; i++) {
+        const char *p = std::max(cuts[i - 1], begin + file.size() * i / nchunks);
+        while (p < end && p[-1] != '\n') p++;
+        cuts[i] = p;
+    }
+    std::vector<obj_chunk> chunks(nchunks);
+    pool.parallel_for(nchunks, [&](int i, int) {
+        parse_chunk(cuts[i], cuts[i + 1], chunks[i]);
+    });
+
+    std::vector<Vec3f> verts;
+    std::vector<Vec3f> norms;
+    std::vector<Vec2f> uvs;
+    std::vector<int> offsets(3 * nchunks);
+    for (int i = 0; i < nchunks; i++) {
+        offsets[3 * i + 0] = (int)verts.size();
+        offsets[3 * i + 1] = (int)uvs.size();
+        offsets[3 * i + 2] = (int)norms.size();
+        verts.insert(verts.end(), chunks[i].verts.begin(), chunks[i].verts.end());
+        uvs.insert(uvs.end(), chunks[i].uvs.begin(), chunks[i].uvs.end());
+        norms.insert(norms.end(), chunks[i].norms.begin(), chunks[i].norms.end());
+    }
+    for (auto &n : norms) n.normalize();
+
+    // px, py, pz, nx, ny, nz, u, v of every distinct vertex
+    std::vector<float> attr[VERTEX_STREAMS];
+    std::vector<uint32_t> &indices = index_data;
+    indices.clear();
+    std::unordered_map<obj_index, uint32_t, obj_index_hash> lookup;
+    std::vector<bool> missing_normal;
+    std::vector<uint32_t> f;
+    for (int i = 0; i < nchunks; i++) {
+        const obj_chunk &c = chunks[i];
+        size_t corner = 0;
+        for (int n : c.face_sizes) {
+            f.clear();
+            bool valid = true;
+            for (int k = 0; k < n; k++, corner++) {
+                obj_index idx = c.corners[corner];
+                unsigned char relative = c.relative[corner];
+                if (relative & 1) idx.v += offsets[3 * i + 0];
+                if (relative & 2) idx.vt += offsets[3 * i + 1];
+                if (relative & 4) idx.vn += offsets[3 * i + 2];
+                if (idx.v < 0 || idx.v >= (int)verts.size()) valid = false;
+                if (idx.vt < 0 || idx.vt >= (int)uvs.size()) idx.vt = -1;
+                if (idx.vn < 0 || idx.vn >= (int)norms.size()) idx.vn = -1;
+                if (!valid) continue;
+                auto it = lookup.find(idx);
+                if (it == lookup.end()) {
+                    uint32_t vi = (uint32_t)attr[0].size();
+                    Vec3f v = verts[idx.v];
+                    Vec3f nn = idx.vn >= 0 ? norms[idx.vn] : Vec3f();
+                    Vec2f uv = idx.vt >= 0 ? uvs[idx.vt] : Vec2f();
+                    attr[0].push_back(v.x); attr[1].push_back(v.y); attr[2].push_back(v.z);
+                    attr[3].push_back(nn.x); attr[4].push_back(nn.y); attr[5].push_back(nn.z);
+                    attr[6].push_back(uv.x); attr[7].push_back(uv.y);
+                    missing_normal.push_back(idx.vn < 0);
+                    it = lookup.insert(std::make_pair(idx, vi)).first;
+                }
+                f.push_back(it->second);
+            }
+            if (!valid) continue;
+            // polygons are split into a fan of triangles
+            for (size_t k = 2; k < f.size(); k++) {
+                indices.push_back(f[0]);
+                indices.push_back(f[k - 1]);
+                indices.push_back(f[k]);
+            }
+        }
+    }
+
+    // vertices the file gave no normal get the area weighted average of their faces' normals
+    bool any_missing = false;
+    for (bool m : missing_normal) any_missing = any_missing || m;
+    if (any_missing) {
+        for (size_t t = 0; t < indices.size(); t += 3) {
+            Vec3f p[3];
+            for (int k = 0; k < 3; k++)
+                p[k] = Vec3f(attr[0][indices[t + k]], attr[1][indices[t + k]], attr[2][indices[t + k]]);
+            Vec3f e1 = p[1] - p[0], e2 = p[2] - p[0];
+            Vec3f n = cross(e1, e2);
+            for (int k = 0; k < 3; k++) {
+                uint32_t i = indices[t + k];
+                if (!missing_normal[i]) continue;
+                attr[3][i] += n.x; attr[4][i] += n.y; attr[5][i] += n.z;
             }
-            faces_.push_back(f);
+        }
+        for (size_t i = 0; i < missing_normal.size(); i++) {
+            if (!missing_normal[i]) continue;
+            Vec3f n(attr[3][i], attr[4][i], attr[5][i]);
+            if (n.norm() > 0.f) n.normalize();
+            attr[3][i] = n.x; attr[4][i] = n.y; attr[5][i] = n.z;
+        }
+    }
+
+    // same layout as the cache file: one stream after the other
+    size_t n = attr[0].size();
+    vertex_data.resize(n * VERTEX_STREAMS);
+    for (int k = 0; k < VERTEX_STREAMS; k++)
+        std::copy(attr[k].begin(), attr[k].end(), vertex_data.begin() + k * n);
+    set_buffers(vertex_data.data(), index_data.data(), (int)n, (int)index_data.size() / 3);
+    std::cerr << "# v# " << verts.size() << " f# "  << nfaces << " vt# " << uvs.size() << " vn# " << norms.size() << " unique# " << nverts << std::endl;
+    return true;
+}
+
+namespace {
+#pragma pack(push,1)
+struct mesh_cache_header {
+    char magic[4];          // "SRMC"
+    uint32_t version;
+    uint32_t byte_order;    // MESH_CACHE_BYTE_ORDER as written by the producing machine
+    uint32_t nverts;
+    uint64_t nindices;
+    uint64_t obj_size;      // the OBJ the cache was built from
+    int64_t obj_mtime;
+};
+#pragma pack(pop)
+
+const uint32_t MESH_CACHE_VERSION = 1;
+const uint32_t MESH_CACHE_BYTE_ORDER = 0x01020304;
+
+bool obj_stamp(const char *filename, uint64_t &size, int64_t &mtime) {
+    std::error_code ec;
+    size = (uint64_t)std::filesystem::file_size(filename, ec);
+    if (ec) return false;
+    mtime = (int64_t)std::filesystem::last_write_time(filename, ec).time_since_epoch().count();
+    return !ec;
+}
+
+std::string cache_filename(const char *filename) {
+    return std::string(filename) + ".bin";
+}
+}
+
+void mesh_t::set_buffers(const float *vertex_buffer, const uint32_t *index_buffer, int vertex_count, int face_count) {
+    nverts = vertex_count;
+    nfaces = face_count;
+    for (int k = 0; k < 3; k++) pos[k] = vertex_buffer + k * (size_t)nverts;
+    for (int k = 0; k < 3; k++) norm[k] = vertex_buffer + (3 + k) * (size_t)nverts;
+    for (int k = 0; k < 2; k++) uv[k] = vertex_buffer + (6 + k) * (size_t)nverts;
+    indices = index_buffer;
+
+    // centered on the bbox, which is close enough to the smallest sphere for culling
+    float lo[3] = {0.f, 0.f, 0.f}, hi[3] = {0.f, 0.f, 0.f};
+    for (int k = 0; k < 3 && nverts > 0; k++) {
+        lo[k] = hi[k] = pos[k][0];
+        for (int i = 1; i < nverts; i++) {
+            lo[k] = std::min(lo[k], pos[k][i]);
+            hi[k] = std::max(hi[k], pos[k][i]);
         }
     }
-    std::cerr << "# v# " << verts_.size() << " f# "  << faces_.size() << " vt# " << uv_.size() << " vn# " << norms_.size() << std::endl;
-    load_texture(filename, "_diffuse.tga", diffusemap_);
-    // load_texture(filename, "_nm_tangent.tga",      normalmap_);
-    // load_texture(filename, "_spec.tga",    specularmap_);
-    load_texture(filename, "_roughness.tga", roughnessmap_);
-    load_texture(filename, "_metalness.tga", metalnessmap_);
+    center = Vec3f((lo[0] + hi[0]) / 2.f, (lo[1] + hi[1]) / 2.f, (lo[2] + hi[2]) / 2.f);
+    float r2 = 0.f;
+    for (int i = 0; i < nverts; i++) {
+        float dx = pos[0][i] - center.x, dy = pos[1][i] - center.y, dz = pos[2][i] - center.z;
+        r2 = std::max(r2, dx * dx + dy * dy + dz * dz);
+    }
+    radius = std::sqrt(r2);
+}
+
+// maps <obj>.bin and points the buffers straight into it, if it was made from this very OBJ
+bool mesh_t::load_cache(const char *filename) {
+    uint64_t size;
+    int64_t mtime;
+    if (!obj_stamp(filename, size, mtime)) return false;
+    std::string cachefile = cache_filename(filename);
+    if (!cache.open(cachefile.c_str())) return false;
+    const mesh_cache_header *header = (const mesh_cache_header *)cache.data();
+    bool ok = cache.size() >= sizeof(mesh_cache_header) && !memcmp(header->magic, "SRMC", 4) &&
+              header->version == MESH_CACHE_VERSION && header->byte_order == MESH_CACHE_BYTE_ORDER &&
+              header->obj_size == size && header->obj_mtime == mtime &&
+              cache.size() == sizeof(mesh_cache_header) + (uint64_t)header->nverts * VERTEX_STREAMS * sizeof(float) + header->nindices * sizeof(uint32_t) &&
+              header->nindices % 3 == 0;
+    if (!ok) {
+        cache.close();
+        return false;
+    }
+    const float *vertex_buffer = (const float *)(cache.data() + sizeof(mesh_cache_header));
+    const uint32_t *index_buffer = (const uint32_t *)(vertex_buffer + (size_t)header->nverts * VERTEX_STREAMS);
+    set_buffers(vertex_buffer, index_buffer, (int)header->nverts, (int)(header->nindices / 3));
+    std::cerr << "mesh cache " << cachefile << " f# " << nfaces << " unique# " << nverts << std::endl;
+    return true;
+}
+
+void mesh_t::save_cache(const char *filename) {
+    mesh_cache_header header;
+    memcpy(header.magic, "SRMC", 4);
+    header.version = MESH_CACHE_VERSION;
+    header.byte_order = MESH_CACHE_BYTE_ORDER;
+    header.nverts = (uint32_t)nverts;
+    header.nindices = (uint64_t)nfaces * 3;
+    if (!obj_stamp(filename, header.obj_size, header.obj_mtime)) return;
+    // written under a temporary name first, so a reader never maps a half written file
+    std::string cachefile = cache_filename(filename);
+    std::string tmpfile = cachefile + ".tmp";
+    std::ofstream out(tmpfile.c_str(), std::ios::binary);
+    out.write((const char *)&header, sizeof(header));
+    out.write((const char *)vertex_data.data(), vertex_data.size() * sizeof(float));
+    out.write((const char *)index_data.data(), index_data.size() * sizeof(uint32_t));
+    out.close();
+    std::error_code ec;
+    if (out.good()) std::filesystem::rename(tmpfile, cachefile, ec);
+    if (!out.good() || ec) {
+        std::filesystem::remove(tmpfile, ec);
+        std::cerr << "can't write mesh cache " << cachefile << std::endl;
+    }
+}
+
+mesh_t::mesh_t() : nverts(0), nfaces(0), indices(NULL), radius(0.f), vertex_data(), index_data(), cache() {
+    for (int k = 0; k < 3; k++) pos[k] = norm[k] = NULL;
+    uv[0] = uv[1] = NULL;
+}
+
+size_t mesh_t::bytes() {
+    return sizeof(*this) + (size_t)nverts * VERTEX_STREAMS * sizeof(float) + (size_t)nfaces * 3 * sizeof(uint32_t);
+}
+
+Model::Model(const char *filename, bool use_cache, bool lazy_textures) : mesh_(), nverts_(0), nfaces_(0), indices_(NULL), filter_(Texture::TRILINEAR) { //, diffusemap_(), normalmap_(), specularmap_()
+    for (int k = 0; k < 3; k++) pos_[k] = norm_[k] = NULL;
+    uv_[0] = uv_[1] = NULL;
+    std::string base(filename);
+    size_t dot = base.find_last_of(".");
+    if (dot != std::string::npos) base = base.substr(0, dot);
+    diffusemap_.filename = base + "_diffuse.tga";
+    // normalmap_.filename = base + "_nm_tangent.tga";
+    // specularmap_.filename = base + "_spec.tga";
+    roughnessmap_.filename = base + "_roughness.tga";
+    metalnessmap_.filename = base + "_metalness.tga";
+    if (dot == std::string::npos) {
+        for (map_t *m : {&diffusemap_, &roughnessmap_, &metalnessmap_})
+            std::call_once(m->loaded, [m] { m->texture = std::make_shared<Texture>(); });   // no file to look for
+    }
+
+    // the maps are read on their own threads while the mesh is parsed
+    std::vector<std::future<void> > loads;
+    if (!lazy_textures) {
+        for (map_t *m : {&diffusemap_, &roughnessmap_, &metalnessmap_})
+            loads.push_back(std::async(std::launch::async, [this, m] { map(*m); }));
+    }
+    mesh_ = AssetCache::instance().get<mesh_t>(filename, [use_cache](const std::string &file) {
+        std::shared_ptr<mesh_t> mesh = std::make_shared<mesh_t>();
+        if (!use_cache || !mesh->load_cache(file.c_str())) {
+            if (!mesh->load_obj(file.c_str())) return std::shared_ptr<mesh_t>();
+            if (use_cache) mesh->save_cache(file.c_str());
+        }
+        return mesh;
+    });
+    if (mesh_) {
+        nverts_ = mesh_->nverts;
+        nfaces_ = mesh_->nfaces;
+        for (int k = 0; k < 3; k++) pos_[k] = mesh_->pos[k];
+        for (int k = 0; k < 3; k++) norm_[k] = mesh_->norm[k];
+        for (int k = 0; k < 2; k++) uv_[k] = mesh_->uv[k];
+        indices_ = mesh_->indices;
+    }
+    for (auto &l : loads) l.wait();
 }
 
 Model::~Model() {}
 
 int Model::nverts() {
-    return (int)verts_.size();
+    return nverts_;
 }
 
 int Model::nfaces() {
-    return (int)faces_.size();
+    return nfaces_;
+}
+
+int Model::vert_index(int iface, int nthvert) {
+    return indices_[iface * 3 + nthvert];
+}
+
+std::vector<int> Model::face(int idx) {
+    return std::vector<int>(indices_ + idx * 3, indices_ + idx * 3 + 3);
+}
+
+Vec3f Model::vert(int i) {
+    return Vec3f(pos_[0][i], pos_[1][i], pos_[2][i]);
 }
 
 Vec3f Model::vert(int iface, int nthvert) {
-    return verts_[faces_[iface][nthvert][0]];
+    return vert(indices_[iface * 3 + nthvert]);
+}
+
+Vec2f Model::uv(int i) {
+    return Vec2f(uv_[0][i], uv_[1][i]);
 }
 
 Vec2f Model::uv(int iface, int nthvert) {
-    return uv_[faces_[iface][nthvert][1]];
+    return uv(indices_[iface * 3 + nthvert]);
 }
 
-void Model::load_texture(std::string filename, const char *suffix, TGAImage &img) {
-    std::string texfile(filename);
-    size_t dot = texfile.find_last_of(".");
-    if (dot!=std::string::npos) {
-        texfile = texfile.substr(0,dot) + std::string(suffix);
-        std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
-        img.flip_vertically();
-    }
+const float *Model::positions(int axis) {
+    return pos_[axis];
 }
 
-Vec3f Model::fromTGAColor(TGAColor& color) {
-    float b = static_cast<float>(color.bgra[0]) / 255.0f;
-    float g = static_cast<float>(color.bgra[1]) / 255.0f;
-    float r = static_cast<float>(color.bgra[2]) / 255.0f;
-    float a = static_cast<float>(color.bgra[3]) / 255.0f;
+const float *Model::normals(int axis) {
+    return norm_[axis];
+}
+
+const float *Model::uvs(int axis) {
+    return uv_[axis];
+}
+
+const uint32_t *Model::indices() {
+    return indices_;
+}
+
+Vec3f Model::bound_center() {
+    return mesh_ ? mesh_->center : Vec3f();
+}
+
+float Model::bound_radius() {
+    return mesh_ ? mesh_->radius : 0.f;
+}
 
-    return Vec3f(r, g, b);  // a may be 0
+void Model::load_textures() {
+    std::vector<std::future<void> > loads;
+    for (map_t *m : {&diffusemap_, &roughnessmap_, &metalnessmap_})
+        loads.push_back(std::async(std::launch::async, [this, m] { map(*m); }));
+    for (auto &l : loads) l.wait();
+}
+
+Texture &Model::map(map_t &m) {
+    std::call_once(m.loaded, [&m] {
+        m.texture = AssetCache::instance().get<Texture>(m.filename, [](const std::string &file) {
+            TGAImage img;
+            bool ok = img.read_tga_file(file.c_str(), true);
+            std::cerr << "texture file " + file + " loading " + (ok ? "ok" : "failed") + "\n";
+            std::shared_ptr<Texture> tex = std::make_shared<Texture>();
+            tex->build(img);
+            return tex;
+        });
+    });
+    return *m.texture;
 }
 
 Vec3f Model::diffuse(Vec2f uvf) {
-    Vec2i uv(uvf[0]*diffusemap_.get_width(), uvf[1]*diffusemap_.get_height());
-    TGAColor c = diffusemap_.get(uv[0], uv[1]);
-    return Model::fromTGAColor(c);
+    Vec4f c = map(diffusemap_).sample(uvf);
+    return Vec3f(c.x, c.y, c.z);
+}
+
+Vec3f Model::diffuse(Vec2f uvf, Vec2f duvdx, Vec2f duvdy) {
+    Vec4f c = map(diffusemap_).sample(uvf, duvdx, duvdy, filter_);
+    return Vec3f(c.x, c.y, c.z);
+}
+
+void Model::set_filter(Texture::Filter filter) {
+    filter_ = filter;
 }
 
 float Model::get_width_diffuse() {
-    return diffusemap_.get_width();
+    return map(diffusemap_).get_width();
 }
 
 float Model::get_height_diffuse() {
-    return diffusemap_.get_height();
+    return map(diffusemap_).get_height();
 }
 
 
+Vec3f Model::normal(int i) {
+    return Vec3f(norm_[0][i], norm_[1][i], norm_[2][i]);
+}
+
 Vec3f Model::normal(int iface, int nthvert) {
-    int idx = faces_[iface][nthvert][2];
-    return norms_[idx].normalize();
+    return normal(indices_[iface * 3 + nthvert]);
 }
 
 float Model::roughness(Vec2f uvf) {
-    Vec2i uv(uvf[0] * roughnessmap_.get_width(), uvf[1] * roughnessmap_.get_height());
-    return roughnessmap_.get(uv[0], uv[1])[0] / 255.f;
+    return map(roughnessmap_).sample(uvf).x;
+}
+
+float Model::roughness(Vec2f uvf, Vec2f duvdx, Vec2f duvdy) {
+    return map(roughnessmap_).sample(uvf, duvdx, duvdy, filter_).x;
 }
 
 float Model::metalness(Vec2f uvf) {
-    Vec2i uv(uvf[0] * metalnessmap_.get_width(), uvf[1] * metalnessmap_.get_height());
-    return metalnessmap_.get(uv[0], uv[1])[0] / 255.f;
+    return map(metalnessmap_).sample(uvf).x;
+}
+
+float Model::metalness(Vec2f uvf, Vec2f duvdx, Vec2f duvdy) {
+    return map(metalnessmap_).sample(uvf, duvdx, duvdy, filter_).x;
 }
@@ -2,35 +2,100 @@
 #define __MODEL_H__
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <mutex>
+#include <memory>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "texture.h"
+#include "mappedfile.h"
+
+// the geometry of an OBJ file: one vertex per distinct position/uv/normal index triple,
+// stored as structure of arrays, plus 3 indices per face into them. The buffers point
+// either into vertex_data/index_data or straight into the mapped mesh cache.
+// Shared by every Model made from the same file, see AssetCache.
+struct mesh_t {
+    static const int VERTEX_STREAMS = 8;
+
+    int nverts;
+    int nfaces;
+    const float *pos[3];
+    const float *norm[3];    // normalized at load time
+    const float *uv[2];
+    const uint32_t *indices;
+    Vec3f center;   // bounding sphere
+    float radius;
+    std::vector<float> vertex_data;    // px, py, pz, nx, ny, nz, u, v streams back to back
+    std::vector<uint32_t> index_data;
+    MappedFile cache;
+
+    mesh_t();
+    bool load_obj(const char *filename);
+    bool load_cache(const char *filename);
+    void save_cache(const char *filename);
+    void set_buffers(const float *vertex_data, const uint32_t *indices, int nverts, int nfaces);
+    size_t bytes();
+};
 
 class Model {
 private:
-    std::vector<Vec3f> verts_;
-    std::vector<std::vector<Vec3i> > faces_; // attention, this Vec3i means vertex/uv/normal
-    std::vector<Vec3f> norms_;
-    std::vector<Vec2f> uv_;
-    TGAImage diffusemap_;
-    TGAImage roughnessmap_;
-    TGAImage metalnessmap_;
+    std::shared_ptr<mesh_t> mesh_;
+    // copied out of mesh_, so the accessors don't go through it
+    int nverts_;
+    int nfaces_;
+    const float *pos_[3];
+    const float *norm_[3];
+    const float *uv_[2];
+    const uint32_t *indices_;
+    // a texture next to the OBJ, read on the first map() call
+    struct map_t {
+        std::string filename;
+        std::shared_ptr<Texture> texture;
+        std::once_flag loaded;
+    };
+    map_t diffusemap_;
+    map_t roughnessmap_;
+    map_t metalnessmap_;
+    Texture::Filter filter_;
 
-    void load_texture(std::string filename, const char *suffix, TGAImage &img);
+    Texture &map(map_t &m);
 public:
-    Model(const char *filename);
+    // use_cache reuses <filename>.bin when it was built from the same OBJ and (re)writes it otherwise.
+    // The texture maps are loaded in parallel with the mesh, or with lazy_textures only when
+    // a shader first samples them. Mesh and maps come from AssetCache::instance(), models of
+    // the same files share them.
+    Model(const char *filename, bool use_cache = true, bool lazy_textures = false);
     ~Model();
     int nverts();
     int nfaces();
+    Vec3f normal(int i);
     Vec3f normal(int iface, int nthvert);
     Vec3f normal(Vec2f uv);
     Vec3f vert(int i);
     Vec3f vert(int iface, int nthvert);
+    Vec2f uv(int i);
     Vec2f uv(int iface, int nthvert);
     std::vector<int> face(int idx);
+    int vert_index(int iface, int nthvert);
+    // contiguous buffers: nverts() floats per axis, 3*nfaces() indices
+    const float *positions(int axis);
+    const float *normals(int axis);
+    const float *uvs(int axis);
+    const uint32_t *indices();
+    // sphere around every vertex, for culling whole models
+    Vec3f bound_center();
+    float bound_radius();
+    // nearest texel of the full resolution maps
     Vec3f diffuse(Vec2f uv);
     float roughness(Vec2f uv);
     float metalness(Vec2f uv);
-    Vec3f fromTGAColor(TGAColor& color);
+    // mipmapped, duvdx and duvdy are the screen space derivatives of uv
+    Vec3f diffuse(Vec2f uv, Vec2f duvdx, Vec2f duvdy);
+    float roughness(Vec2f uv, Vec2f duvdx, Vec2f duvdy);
+    float metalness(Vec2f uv, Vec2f duvdx, Vec2f duvdy);
+    void set_filter(Texture::Filter filter);    // of all maps, TRILINEAR by default
+    // reads the maps not read yet, e.g. of a lazy_textures model, in parallel
+    void load_textures();
     float get_width_diffuse();
     float get_height_diffuse();
 };
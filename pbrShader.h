@@ -53,17 +53,31 @@ Vec3f mix(Vec3f a, Vec3f b, float c) {
     return a + (b - a) * c;
 }
 
-struct pbr_shader : public Shader {
-    Vec4f n[3];
+struct pbr_shader final : public Shader {
+    static const bool receives_shadows = true;
+    Vec3f n[3];
     Vec2f uv[3];
-    Vec4f pos[3];
-
-    virtual Vec4f vertex(int iface, int nthvert) {
-        Vec4f v = payload.m_viewport * payload.mvp * proj4(payload.obj->vert(iface, nthvert));
-        n[nthvert] = (payload.m_view * payload.m_model).inv().transpose() * proj4((payload.obj->normal(iface, nthvert))); // view space
-        uv[nthvert] = payload.obj->uv(iface, nthvert);
-        pos[nthvert] = payload.m_model * proj4(payload.obj->vert(iface, nthvert));
-        return v;
+    Vec3f pos[3];
+    Vec3f ls[3];
+
+    struct varying_t { Vec3f n; Vec2f uv; Vec3f pos; Vec3f ls; };
+
+    virtual Shader *clone() const { return new pbr_shader(*this); }
+
+    virtual int varying_size() { return sizeof(varying_t) / sizeof(float); }
+    virtual void vertex(int ivert, float *varyings) {
+        varying_t &out = *(varying_t *)varyings;
+        out.n = proj3(payload.uniform.normal_matrix * proj4(payload.obj->normal(ivert))).normalize(); // view space
+        out.uv = payload.obj->uv(ivert);
+        out.pos = proj3(payload.m_model * proj4(payload.obj->vert(ivert))).normalize();
+        out.ls = light_space(ivert);
+    }
+    virtual void assemble(int nthvert, const float *varyings) {
+        const varying_t &in = *(const varying_t *)varyings;
+        n[nthvert] = in.n;
+        uv[nthvert] = in.uv;
+        pos[nthvert] = in.pos;
+        ls[nthvert] = in.ls;
     }
     virtual Vec3f fragment(Vec3f bc) {
         float u = 0., v = 0.;
@@ -72,17 +86,19 @@ struct pbr_shader : public Shader {
             v += uv[i].y * bc[i];
         }
         Vec2f uvf(u, v);
-        Vec3f albedo = payload.obj->diffuse(uvf);
+        Vec2f duvdx = uv[0] * bc_dx.x + uv[1] * bc_dx.y + uv[2] * bc_dx.z;
+        Vec2f duvdy = uv[0] * bc_dy.x + uv[1] * bc_dy.y + uv[2] * bc_dy.z;
+        Vec3f albedo = payload.obj->diffuse(uvf, duvdx, duvdy);
 
-        float roughness = payload.obj->roughness(uvf);
-        float metalness = payload.obj->metalness(uvf);
+        float roughness = payload.obj->roughness(uvf, duvdx, duvdy);
+        float metalness = payload.obj->metalness(uvf, duvdx, duvdy);
 
         Vec3f F0(0.04f, 0.04f, 0.04f);
         F0 = mix(F0, albedo, metalness);
 
-        Vec3f N = proj3(n[0]).normalize() * bc.x + proj3(n[1]).normalize() * bc.y + proj3(n[2]).normalize() * bc.z;
+        Vec3f N = n[0] * bc.x + n[1] * bc.y + n[2] * bc.z;
         N = N.normalize();
-        Vec3f fragpos = proj3(pos[0]).normalize() * bc.x + proj3(pos[1]).normalize() * bc.y + proj3(pos[2]).normalize() * bc.z;
+        Vec3f fragpos = pos[0] * bc.x + pos[1] * bc.y + pos[2] * bc.z;
         Vec3f V = (payload.camera - fragpos).normalize();
         float NdotV = std::max(dot(N, V), 0.0f);
 
@@ -101,7 +117,7 @@ struct pbr_shader : public Shader {
         Vec3f BRDF = numerator / denominator;
         
         Vec3f kd = (Vec3f(1.0, 1.0, 1.0) - F) * (1.f - metalness);
-        Vec3f Lo = (albedo * kd / M_PI + BRDF) * radiance * NdotL;  // Cook-Torrance BRDF
+        Vec3f Lo = (albedo * kd / M_PI + BRDF) * radiance * NdotL * shadow(ls, bc);  // Cook-Torrance BRDF
         Vec3f color = Lo;
 
         //color = color / (color + Vec3f(1.f, 1.f, 1.f));
@@ -0,0 +1,339 @@
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include "rasterizer.h"
+
+const int Rasterizer::HIZ_BLOCK;
+static_assert(Rasterizer::HIZ_BLOCK == Framebuffer::TILE, "a Hi-Z block is prepared as one framebuffer tile");
+
+Rasterizer::Rasterizer(int w, int h, int tile, ThreadPool *pool) : pool_(pool ? pool : &ThreadPool::instance()), width(w), height(h), tile_size(tile), tris_(), bins_(), hiz_(), deferred_(false), vis_(), sample_z_(), sample_color_(), samples_pending_(false), draws_(), early_z(true), deferred(false), cull_backfaces(true), samples(1), timings() {
+	tile_size = std::max(HIZ_BLOCK, tile_size - tile_size % HIZ_BLOCK);	// tiles are made of whole Hi-Z blocks
+	ntiles_x = (width + tile_size - 1) / tile_size;
+	ntiles_y = (height + tile_size - 1) / tile_size;
+	hiz_width = (width + HIZ_BLOCK - 1) / HIZ_BLOCK;
+	hiz_.resize(hiz_width * ((height + HIZ_BLOCK - 1) / HIZ_BLOCK));
+	sample_tiles_.resize(ntiles_x * ntiles_y);
+}
+
+// sets up t from its screen space corners and appends it to the bins of the tiles its bbox
+// overlaps, unless it is back facing, degenerate or off screen
+void Rasterizer::add_triangle(triangle_t &t, int chunk) {
+	Vec3f v0 = proj3(t.v[0]);
+	Vec3f v1 = proj3(t.v[1]);
+	Vec3f v2 = proj3(t.v[2]);
+	float area = (v2.x - v0.x) * (v1.y - v0.y) - (v2.y - v0.y) * (v1.x - v0.x);
+	if (!(std::fabs(area) > 0.f)) return;	// degenerate (or NaN)
+	if (cull_backfaces && area < 0.f) return;
+	float bboxmin_x = std::max(0.f, std::min(v0.x, std::min(v1.x, v2.x)));
+	float bboxmax_x = std::min(width - 1.f, std::max(v0.x, std::max(v1.x, v2.x)));
+	float bboxmin_y = std::max(0.f, std::min(v0.y, std::min(v1.y, v2.y)));
+	float bboxmax_y = std::min(height - 1.f, std::max(v0.y, std::max(v1.y, v2.y)));
+	if (!(bboxmin_x <= bboxmax_x && bboxmin_y <= bboxmax_y)) return;	// off screen
+	t.x0 = (int)bboxmin_x;
+	t.y0 = (int)bboxmin_y;
+	t.x1 = (int)std::floor(bboxmax_x);
+	t.y1 = (int)std::floor(bboxmax_y);
+
+	std::vector<triangle_t> &tris = tris_[chunk];
+	std::vector<std::vector<int> > &bins = bins_[chunk];
+	int idx = (int)tris.size();
+	tris.push_back(t);
+	for (int ty = t.y0 / tile_size; ty <= t.y1 / tile_size; ty++)
+		for (int tx = t.x0 / tile_size; tx <= t.x1 / tile_size; tx++)
+			bins[tx + ty * ntiles_x].push_back(idx);
+}
+
+// primitive assembly for faces [begin, end): corners come from the vertex stage output, faces
+// crossing the near plane are clipped against it. The sides of the screen need no clipping,
+// the bbox clamp in add_triangle() acts as a guard band.
+void Rasterizer::bin(const draw_t &d, int chunk, int begin, int end) {
+	tris_[chunk].clear();
+	for (auto &b : bins_[chunk]) b.clear();
+
+	for (int i = begin; i < end; i++) {
+		triangle_t t;
+		t.iface = i;
+		t.clipped = false;
+		for (int j = 0; j < 3; j++) {
+			uint32_t k = d.indices[i * 3 + j];
+			t.v[j] = Vec4f(d.screen[0][k], d.screen[1][k], d.screen[2][k], d.screen[3][k]);
+		}
+		if (!d.clip_near) {
+			add_triangle(t, chunk);
+			continue;
+		}
+		// the projection puts the near plane at z = w in clip space (z_ndc = 1), and the viewport keeps z and w
+		float dist[3];
+		int inside = 0;
+		for (int j = 0; j < 3; j++) {
+			dist[j] = t.v[j].z - t.v[j].w;
+			inside += dist[j] >= 0.f;
+		}
+		if (inside == 3) {
+			add_triangle(t, chunk);
+			continue;
+		}
+		if (inside == 0) continue;
+
+		// Sutherland-Hodgman against the one plane, the result is a triangle or a quad. Corners
+		// keep their barycentrics in the face, so the varyings need no clipping.
+		Vec4f v[4];
+		Vec3f bc[4];
+		const Vec3f corner[3] = {Vec3f(1, 0, 0), Vec3f(0, 1, 0), Vec3f(0, 0, 1)};
+		int n = 0;
+		for (int j = 0; j < 3; j++) {
+			int k = (j + 1) % 3;
+			if (dist[j] >= 0.f) {
+				v[n] = t.v[j];
+				bc[n++] = corner[j];
+			}
+			if ((dist[j] >= 0.f) != (dist[k] >= 0.f)) {
+				float s = dist[j] / (dist[j] - dist[k]);
+				v[n] = t.v[j] + (t.v[k] - t.v[j]) * s;
+				bc[n++] = corner[j] + (corner[k] - corner[j]) * s;
+			}
+		}
+		t.clipped = true;
+		for (int j = 1; j + 1 < n; j++) {
+			triangle_t c = t;
+			c.v[0] = v[0]; c.v[1] = v[j]; c.v[2] = v[j + 1];
+			c.bc[0] = bc[0]; c.bc[1] = bc[j]; c.bc[2] = bc[j + 1];
+			add_triangle(c, chunk);
+		}
+	}
+}
+
+void Rasterizer::gradient_t::setup(const Vec4f *v, const Vec3f *bc) {
+	Vec3f v0 = proj3(v[0]);
+	Vec3f v1 = proj3(v[1]);
+	Vec3f v2 = proj3(v[2]);
+	float area = (v2.x - v0.x) * (v1.y - v0.y) - (v2.y - v0.y) * (v1.x - v0.x);
+	if (!(std::fabs(area) > 0.f) || v[0].w == 0.f || v[1].w == 0.f || v[2].w == 0.f) {
+		px = py = Vec3f(0, 0, 0);	// no derivatives, texture lookups use the finest level
+		sx = sy = 0.f;
+		return;
+	}
+	float inv_area = 1.f / area;
+	float iw0 = 1.f / v[0].w, iw1 = 1.f / v[1].w, iw2 = 1.f / v[2].w;
+	px = Vec3f((v2.y - v1.y) * inv_area * iw0, (v0.y - v2.y) * inv_area * iw1, (v1.y - v0.y) * inv_area * iw2);
+	py = Vec3f((v1.x - v2.x) * inv_area * iw0, (v2.x - v0.x) * inv_area * iw1, (v0.x - v1.x) * inv_area * iw2);
+	sx = px.x + px.y + px.z;
+	sy = py.x + py.y + py.z;
+	if (bc) {
+		px = bc[0] * px.x + bc[1] * px.y + bc[2] * px.z;
+		py = bc[0] * py.x + bc[1] * py.y + bc[2] * py.z;
+	}
+}
+
+// farthest depth left in the block, nothing drawn there can fail the test against more than this.
+// depth holds samples values per pixel.
+void Rasterizer::update_hiz(int bx, int by, const float *depth, int samples) {
+	int x1 = std::min(bx + HIZ_BLOCK, width), y1 = std::min(by + HIZ_BLOCK, height);
+	int n = (x1 - bx) * samples;
+	float zmin = std::numeric_limits<float>::max();
+	vfloat vzmin(zmin);
+	for (int y = by; y < y1; y++) {
+		const float *row = depth + (size_t)(bx + y * width) * samples;
+		int x = 0;
+		for (; x + SIMD_WIDTH <= n; x += SIMD_WIDTH) vzmin = vmin(vzmin, vfloat::load(row + x));
+		for (; x < n; x++) zmin = std::min(zmin, row[x]);
+	}
+	float lanes[SIMD_WIDTH];
+	vzmin.store(lanes);
+	for (int i = 0; i < SIMD_WIDTH; i++) zmin = std::min(zmin, lanes[i]);
+	hiz_[bx / HIZ_BLOCK + (by / HIZ_BLOCK) * hiz_width] = zmin;
+}
+
+void Rasterizer::update_hiz(int bx, int by, const Framebuffer &fb) {
+	if (fb.cleared(bx / HIZ_BLOCK, by / HIZ_BLOCK)) {
+		hiz_[bx / HIZ_BLOCK + (by / HIZ_BLOCK) * hiz_width] = fb.clear_depth();
+		return;
+	}
+	if (fb.depth_f32()) return update_hiz(bx, by, fb.depth_f32(), 1);
+	int x1 = std::min(bx + HIZ_BLOCK, width), y1 = std::min(by + HIZ_BLOCK, height);
+	float zmin = std::numeric_limits<float>::max();
+	for (int y = by; y < y1; y++)
+		for (int x = bx; x < x1; x++) zmin = std::min(zmin, fb.depth(x + y * width));
+	hiz_[bx / HIZ_BLOCK + (by / HIZ_BLOCK) * hiz_width] = zmin;
+}
+
+// the depth fb stores at the corners v of a triangle, when it is linear in screen space: true
+// for fixed point depth and affine draws. Otherwise it is the view space z, 1 / sum(e_i / w_i).
+bool Rasterizer::corner_depths(const Vec4f *v, const draw_t &d, const Framebuffer &fb, float dz[3]) const {
+	bool affine = !d.clip_near;
+	float range = fb.depth_range();
+	for (int j = 0; j < 3; j++)
+		dz[j] = range == 0.f ? v[j].z : affine ? (v[j].z + 1.f) * 0.5f * range : d.w_near / v[j].w * range;
+	return affine || range > 0.f;
+}
+
+// whether obj's bounding sphere is entirely on the outer side of a side or the near plane
+// of the frustum, m being the object to screen space transform
+bool Rasterizer::outside_frustum(const Matrix4f &m, bool perspective, Model *obj) {
+	// planes over screen space (x, y, z, w), a point is inside when all are >= 0. In front of a
+	// perspective camera w is negative, so 0 <= x / w <= width flips to x <= 0 and x >= width * w.
+	float s = perspective ? -1.f : 1.f;
+	float planes[5][4] = {
+		{s, 0, 0, 0}, {-s, 0, 0, s * width},
+		{0, s, 0, 0}, {0, -s, 0, s * height},
+		{0, 0, 1, -1},	// near, see bin()
+	};
+	Vec3f c = obj->bound_center();
+	float r = obj->bound_radius();
+	for (int i = 0; i < (perspective ? 5 : 4); i++) {
+		// the same plane in object space
+		float p[4];
+		for (int j = 0; j < 4; j++)
+			p[j] = planes[i][0] * m[0][j] + planes[i][1] * m[1][j] + planes[i][2] * m[2][j] + planes[i][3] * m[3][j];
+		float len = std::sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+		if (p[0] * c.x + p[1] * c.y + p[2] * c.z + p[3] < -r * len) return true;
+	}
+	return false;
+}
+
+// everything of draw() that does not depend on the shader type, up to the vertex stage.
+// NULL when there is nothing to draw.
+Rasterizer::draw_t *Rasterizer::begin_draw(Shader &shader, bool depth_only) {
+	ThreadPool &pool = *pool_;
+	shader.payload.compile();
+	Model *obj = shader.payload.obj;
+	Matrix4f m = shader.position_matrix();
+	// an affine position_matrix() (orthographic) has w = 1 and nothing to clip
+	bool perspective = m[3][0] != 0.f || m[3][1] != 0.f || m[3][2] != 0.f || m[3][3] != 1.f;
+	if (outside_frustum(m, perspective, obj)) return NULL;
+	// after the culling, a shader's uniforms may load what it samples, e.g. a lazy texture
+	shader.compile();
+	int nverts = obj->nverts();
+	int nchunks = pool.size();
+	int ntiles = ntiles_x * ntiles_y;
+	tris_.resize(nchunks);
+	bins_.resize(nchunks);
+	for (auto &b : bins_) b.resize(ntiles);
+
+	// the standard D3D sample positions, in 1/16 pixel
+	static const int pattern2[2][2] = {{4, 4}, {-4, -4}};
+	static const int pattern4[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+	static const int pattern8[8][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+	int ns = depth_only || samples < 2 ? 1 : samples < 4 ? 2 : samples < 8 ? 4 : 8;
+	const int (*pattern)[2] = ns == 2 ? pattern2 : ns == 4 ? pattern4 : pattern8;
+	if (ns > 1) {
+		for (int s = 0; s < ns; s++) {
+			sample_dx_[s] = pattern[s][0] / 16.f;
+			sample_dy_[s] = pattern[s][1] / 16.f;
+		}
+		size_t n = (size_t)width * height * ns;
+		if (sample_z_.size() != n) {
+			sample_z_.assign(n, -std::numeric_limits<float>::max());
+			sample_color_.resize(n);
+		}
+		samples_pending_ = true;
+	}
+
+	// deferred shading needs the depth of a pixel to be final before it is shaded
+	deferred_ = deferred && early_z && !depth_only;
+	size_t nvis = (size_t)width * height * ns;
+	if (deferred_ && vis_.size() != nvis) vis_.assign(nvis, vis_t{-1, 0, 0.f, 0.f});
+
+	draws_.push_back(draw_t());
+	draw_t &d = draws_.back();
+	d.clip_near = perspective;
+	d.w_near = 0.f;
+	if (perspective) {
+		// the projection makes z = a * w + b, and the near plane is where z = w (see bin())
+		int j = 0;
+		for (int k = 1; k < 3; k++)
+			if (std::fabs(m[3][k]) > std::fabs(m[3][j])) j = k;
+		float a = m[2][j] / m[3][j], b = m[2][3] - a * m[3][3];
+		d.w_near = b / (1.f - a);
+	}
+	d.samples = ns;
+	d.shaders.resize(pool.size());
+	for (auto &s : d.shaders) s = shader.clone();
+	d.indices = obj->indices();
+	d.stride = depth_only ? 0 : shader.varying_size();
+	d.varyings.resize((size_t)nverts * d.stride);
+	for (auto &s : d.screen) s.resize(nverts);
+	d.touched.assign(ntiles, 0);
+	return &d;
+}
+
+void Rasterizer::end_draw() {
+	if (deferred_) return;	// kept for resolve()
+	for (auto s : draws_.back().shaders) delete s;
+	draws_.pop_back();
+}
+
+void Rasterizer::resolve(Framebuffer &fb) {
+	if (draws_.empty() && !samples_pending_) return;
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	ThreadPool &pool = *pool_;
+	pool.parallel_for(ntiles_x * ntiles_y, [&](int tile, int thread) {
+		for (int i = 0; i < (int)draws_.size(); i++)
+			if (draws_[i].touched[tile]) (this->*draws_[i].resolve)(i, tile, thread, fb);
+		if (sample_tiles_[tile]) resolve_samples(tile, fb);
+		sample_tiles_[tile] = 0;
+	});
+	samples_pending_ = false;
+	for (auto &d : draws_)
+		for (auto s : d.shaders) delete s;
+	draws_.clear();
+	timings.shade += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// every sample of a pixel of tile to fb's depth and color there. Pixels fb still waits to
+// clear, or cleared ones, keep samples that are cleared as well.
+void Rasterizer::seed_samples(int tile, Framebuffer &fb) {
+	int ns = (int)(sample_z_.size() / ((size_t)width * height));
+	int x0 = (tile % ntiles_x) * tile_size;
+	int y0 = (tile / ntiles_x) * tile_size;
+	int x1 = std::min(x0 + tile_size, width) - 1;
+	int y1 = std::min(y0 + tile_size, height) - 1;
+	const int T = Framebuffer::TILE;
+	for (int by = y0; by <= y1; by += T)
+		for (int bx = x0; bx <= x1; bx += T) {
+			if (fb.cleared(bx / T, by / T)) continue;
+			for (int y = by; y <= std::min(by + T - 1, y1); y++)
+				for (int x = bx; x <= std::min(bx + T - 1, x1); x++) {
+					size_t idx = (size_t)(x + y * width);
+					float z = fb.depth(idx);
+					if (z == fb.clear_depth()) continue;
+					Vec3f c = fb.color(idx);
+					for (int s = 0; s < ns; s++) {
+						sample_z_[idx * ns + s] = z;
+						sample_color_[idx * ns + s] = c;
+					}
+				}
+		}
+}
+
+// box filter over the samples of each pixel of tile, uncovered ones keep the color fb was
+// cleared to. The samples are left cleared for the next frame.
+void Rasterizer::resolve_samples(int tile, Framebuffer &fb) {
+	int ns = (int)(sample_z_.size() / ((size_t)width * height));
+	int x0 = (tile % ntiles_x) * tile_size;
+	int y0 = (tile / ntiles_x) * tile_size;
+	int x1 = std::min(x0 + tile_size, width) - 1;
+	int y1 = std::min(y0 + tile_size, height) - 1;
+	const float cleared = -std::numeric_limits<float>::max();
+	for (int y = y0; y <= y1; y++)
+		for (int x = x0; x <= x1; x++) {
+			size_t idx = (size_t)(x + y * width);
+			float *sz = &sample_z_[idx * ns];
+			const Vec3f *sc = &sample_color_[idx * ns];
+			Vec3f sum(0, 0, 0);
+			int covered = 0;
+			for (int s = 0; s < ns; s++) {
+				if (sz[s] == cleared) continue;
+				sum = sum + sc[s];
+				covered++;
+				sz[s] = cleared;
+			}
+			if (!covered) continue;
+			fb.set_color(idx, (sum + fb.color(idx) * (float)(ns - covered)) / (float)ns);
+		}
+}
+
+Rasterizer::~Rasterizer() {
+	for (auto &d : draws_)
+		for (auto s : d.shaders) delete s;
+}
@@ -0,0 +1,599 @@
+#ifndef __RASTERIZER_H__
+#define __RASTERIZER_H__
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include <chrono>
+#include "geometry.h"
+#include "shader.h"
+#include "framebuffer.h"
+#include "threadpool.h"
+#include "simd.h"
+
+// tile-binned rasterizer: the unique vertices are transformed once, faces are assembled
+// from them and sorted into screen tiles, then the tiles are rasterized and shaded in parallel. A tile only ever touches its
+// own pixels of the framebuffer, so the depth test needs no locking. Tiles no face reaches are
+// left alone, cleared framebuffer tiles included.
+// The pipeline is templated on the shader type: drawing a final shader class calls its
+// vertex()/assemble()/fragment() directly and lets them inline into the pixel loop, drawing
+// through a Shader & falls back to virtual calls.
+class Rasterizer {
+private:
+    struct triangle_t {
+        Vec4f v[3];     // screen space, w keeps the view space z
+        int iface;
+        int x0, y0, x1, y1; // pixel bounding box, clamped to the screen
+        bool clipped;   // cut by the near plane, then bc holds the barycentrics of v in the face
+        Vec3f bc[3];
+    };
+    // visibility buffer texel: which face of which draw is visible and where
+    struct vis_t {
+        int draw;       // -1 when nothing was drawn
+        int iface;
+        float b0, b1;   // perspective correct barycentrics, the third one is 1 - b0 - b1
+    };
+    struct draw_t {
+        std::vector<Shader*> shaders;   // per-thread copies, of the type draw() was called with
+        void (Rasterizer::*resolve)(int draw, int tile, int thread, Framebuffer &fb);   // resolve_tile<that type>
+        const uint32_t *indices;        // 3 per face into the vertex buffers
+        bool clip_near;                 // perspective position_matrix(), w is the view space z
+        float w_near;                   // w at the near plane then, for fixed point depth
+        int samples;                    // per pixel, > 1 when drawn into the MSAA sample buffers
+        int stride;                     // varying floats per vertex
+        std::vector<float> screen[4];   // vertex stage screen space x, y, z, w per unique vertex
+        std::vector<float> varyings;    // vertex stage output, per unique vertex
+        std::vector<unsigned char> touched;     // per tile, whether any face was binned to it
+    };
+    // screen space derivatives of the perspective correct barycentrics over a triangle.
+    // With p_i = e_i / w_i (e_i screen space barycentrics), bc_i = p_i / sum(p) and
+    // sum(p) = 1 / z, so d(bc_i)/dx = (d(p_i)/dx - bc_i * d(sum(p))/dx) * z.
+    struct gradient_t {
+        Vec3f px, py;   // d(p)/dx and d(p)/dy, mapped by the corner barycentrics of clipped triangles
+        float sx, sy;   // d(sum(p))/dx and /dy
+        // bc: NULL, or barycentrics of v in the face
+        void setup(const Vec4f *v, const Vec3f *bc);
+        void eval(const Vec3f &bc, float z, Vec3f &dx, Vec3f &dy) const {
+            dx = (px - bc * sx) * z;
+            dy = (py - bc * sy) * z;
+        }
+    };
+
+    ThreadPool *pool_;
+    int width;
+    int height;
+    int tile_size;
+    int ntiles_x;
+    int ntiles_y;
+    std::vector<std::vector<triangle_t> > tris_;          // post-transform faces, per chunk of faces
+    std::vector<std::vector<std::vector<int> > > bins_;   // indices into tris_, per chunk, per tile
+    int hiz_width;
+    std::vector<float> hiz_;    // Hi-Z, farthest depth in the framebuffer per HIZ_BLOCK x HIZ_BLOCK block
+    bool deferred_;             // mode of the current draw
+    std::vector<vis_t> vis_;    // samples per pixel, pixel by pixel
+    // MSAA: depth and color of every sample, pixel by pixel, and where the samples sit in the
+    // pixel relative to its center, depth quantized as the framebuffer's. A sample still at
+    // -max depth is not covered, resolve() lets the framebuffer's color show through there
+    // and clears the depth again.
+    std::vector<float> sample_z_;
+    std::vector<Vec3f> sample_color_;
+    float sample_dx_[8], sample_dy_[8];
+    bool samples_pending_;      // MSAA draws since the last resolve()
+    std::vector<unsigned char> sample_tiles_;   // per tile, whether they drew to it
+    std::vector<draw_t> draws_;     // the current draw last, earlier ones are waiting for resolve()
+
+    static Vec3f correction_gamma(Vec3f c) {
+        /*c.x = pow(c.x, 1.0 / 2.0);
+        c.y = pow(c.y, 1.0 / 2.0);
+        c.z = pow(c.z, 1.0 / 2.0);*/
+        return c;
+    }
+    bool outside_frustum(const Matrix4f &m, bool perspective, Model *obj);
+    draw_t *begin_draw(Shader &shader, bool depth_only);
+    void end_draw();
+    template <class ShaderT> void transform(draw_t &d, int thread, int begin, int end);
+    void add_triangle(triangle_t &t, int chunk);
+    void bin(const draw_t &d, int chunk, int begin, int end);
+    template <class ShaderT> bool raster_tile(const draw_t &d, int thread, int tile, Framebuffer &fb);
+    void update_hiz(int bx, int by, const float *depth, int samples);
+    void update_hiz(int bx, int by, const Framebuffer &fb);
+    bool corner_depths(const Vec4f *v, const draw_t &d, const Framebuffer &fb, float dz[3]) const;
+    template <class ShaderT> void assemble(const draw_t &d, ShaderT &shader, int iface);
+    template <class ShaderT> void triangle(const triangle_t &t, const draw_t &d, ShaderT &shader, int x0, int y0, int x1, int y1, Framebuffer &fb);
+    template <class ShaderT> void triangle_ms(const triangle_t &t, const draw_t &d, ShaderT &shader, int x0, int y0, int x1, int y1, Framebuffer &fb);
+    template <class ShaderT> void resolve_tile(int draw, int tile, int thread, Framebuffer &fb);
+    void seed_samples(int tile, Framebuffer &fb);
+    void resolve_samples(int tile, Framebuffer &fb);
+public:
+    static const int HIZ_BLOCK = 8;
+
+    // depth test before the fragment shader plus Hi-Z block rejection,
+    // turn it off for shaders that would write their own depth
+    bool early_z;
+    // visibility buffer mode: draw() only stores face id + barycentrics of the visible
+    // surface and resolve() shades each pixel once. Needs early_z.
+    bool deferred;
+    // skip faces wound clockwise on screen, for closed meshes with consistent winding
+    bool cull_backfaces;
+    // MSAA samples per pixel: 1 (off), 2, 4 or 8. Coverage and depth are per sample while
+    // fragment() runs once per pixel and face. Drawn colors only reach fb in resolve(),
+    // which then needs calling after every frame, forward or deferred. Depth-only draws
+    // stay single sampled. The samples of a tile start from the depth and color fb holds
+    // when the first MSAA draw since resolve() reaches it, so single sampled draws before
+    // that are depth tested against, those in between MSAA draws are not.
+    int samples;
+    // milliseconds spent per stage, added up over draw() and resolve() calls until set back to
+    // zero. Forward draws shade while they rasterize, deferred ones in resolve().
+    struct timings_t {
+        double vertex;  // vertex stage, with the draw's setup
+        double bin;     // primitive assembly, clipping and binning
+        double raster;
+        double shade;   // resolve()
+    };
+    timings_t timings;
+
+    // pool runs the tiles, ThreadPool::instance() when NULL. Renderers that each draw on one
+    // thread of a pool of their own, e.g. a ThreadPool(1), can work on several frames at once.
+    Rasterizer(int w, int h, int tile = 32, ThreadPool *pool = NULL);
+    ~Rasterizer();
+    // draws every face of shader.payload.obj into fb, which has the rasterizer's size. For a
+    // ShaderT::depth_only shader only depth is written, with neither varyings nor fragment()
+    // calls, and fb may have NO_COLOR. Colors are converted to fb's format as they are written.
+    // Fixed point depth holds w_near / w of perspective draws scaled to the format's range,
+    // reversed from the near plane down to 0 at infinity, and (z + 1) / 2 of affine ones.
+    // Both are linear in screen space, so they are interpolated without a division.
+    template <class ShaderT> void draw(ShaderT &shader, Framebuffer &fb);
+    // shades what the deferred draws since the last call left visible and averages the MSAA
+    // samples into fb, no-op otherwise
+    void resolve(Framebuffer &fb);
+};
+
+// vertex stage for vertices [begin, end): positions go through position_matrix() SIMD_WIDTH
+// at a time straight from the model's SoA buffers, then the shader writes the varyings
+template <class ShaderT>
+void Rasterizer::transform(draw_t &d, int thread, int begin, int end) {
+	ShaderT &shader = *static_cast<ShaderT *>(d.shaders[thread]);
+	Model *obj = shader.payload.obj;
+	Matrix4f m = shader.position_matrix();
+	const float *px = obj->positions(0), *py = obj->positions(1), *pz = obj->positions(2);
+	int i = begin;
+	for (; i + SIMD_WIDTH <= end; i += SIMD_WIDTH) {
+		vfloat x = vfloat::load(px + i), y = vfloat::load(py + i), z = vfloat::load(pz + i);
+		for (int r = 0; r < 4; r++)
+			(vfloat(m[r][0]) * x + vfloat(m[r][1]) * y + vfloat(m[r][2]) * z + vfloat(m[r][3])).store(&d.screen[r][i]);
+	}
+	for (; i < end; i++)
+		for (int r = 0; r < 4; r++)
+			d.screen[r][i] = m[r][0] * px[i] + m[r][1] * py[i] + m[r][2] * pz[i] + m[r][3];
+	if (ShaderT::depth_only) return;
+	for (i = begin; i < end; i++)
+		shader.vertex(i, &d.varyings[(size_t)i * d.stride]);
+}
+
+// false when no face was binned to tile
+template <class ShaderT>
+bool Rasterizer::raster_tile(const draw_t &d, int thread, int tile, Framebuffer &fb) {
+	bool empty = true;
+	for (size_t c = 0; c < bins_.size() && empty; c++) empty = bins_[c][tile].empty();
+	if (empty) return false;
+	ShaderT &shader = *static_cast<ShaderT *>(d.shaders[thread]);
+	int x0 = (tile % ntiles_x) * tile_size;
+	int y0 = (tile / ntiles_x) * tile_size;
+	int x1 = std::min(x0 + tile_size, width) - 1;
+	int y1 = std::min(y0 + tile_size, height) - 1;
+	if (d.samples > 1 && !sample_tiles_[tile]) seed_samples(tile, fb);
+	if (early_z) {
+		// the depth may have been cleared or written since the last draw, so rebuild this tile's Hi-Z
+		for (int by = y0; by <= y1; by += HIZ_BLOCK)
+			for (int bx = x0; bx <= x1; bx += HIZ_BLOCK) {
+				if (d.samples > 1) update_hiz(bx, by, sample_z_.data(), d.samples);
+				else update_hiz(bx, by, fb);
+			}
+	}
+	// chunks hold consecutive faces, so this keeps the submission order per pixel
+	for (size_t c = 0; c < bins_.size(); c++) {
+		for (int idx : bins_[c][tile]) {
+			const triangle_t &t = tris_[c][idx];
+			if (d.samples > 1)
+				triangle_ms<ShaderT>(t, d, shader, std::max(x0, t.x0), std::max(y0, t.y0), std::min(x1, t.x1), std::min(y1, t.y1), fb);
+			else
+				triangle<ShaderT>(t, d, shader, std::max(x0, t.x0), std::max(y0, t.y0), std::min(x1, t.x1), std::min(y1, t.y1), fb);
+		}
+	}
+	return true;
+}
+
+// hands the cached varyings of the face's corners to shader
+template <class ShaderT>
+void Rasterizer::assemble(const draw_t &d, ShaderT &shader, int iface) {
+	for (int j = 0; j < 3; j++)
+		shader.assemble(j, &d.varyings[(size_t)d.indices[iface * 3 + j] * d.stride]);
+}
+
+// edge function rasterizer: the three edge equations are set up once per triangle and
+// stepped incrementally, coverage is tested for SIMD_WIDTH pixels of a row at a time.
+// The bbox is walked in HIZ_BLOCK x HIZ_BLOCK blocks so that a block the triangle misses,
+// or that is entirely behind what is already in fb, is skipped at once.
+template <class ShaderT>
+void Rasterizer::triangle(const triangle_t &t, const draw_t &d, ShaderT &shader, int x0, int y0, int x1, int y1, Framebuffer &fb) {
+	const Vec4f *v = t.v;
+	Vec3f v0 = proj3(v[0]);
+	Vec3f v1 = proj3(v[1]);
+	Vec3f v2 = proj3(v[2]);
+
+	float area = (v2.x - v0.x) * (v1.y - v0.y) - (v2.y - v0.y) * (v1.x - v0.x);
+	if (!(std::fabs(area) > 0.f)) return;	// degenerate (or NaN)
+	float inv_area = 1.f / area;
+	// scaled by 1/area, so edge i evaluates to the screen space barycentric coordinate i
+	float a0 = (v2.y - v1.y) * inv_area, b0 = (v1.x - v2.x) * inv_area;
+	float a1 = (v0.y - v2.y) * inv_area, b1 = (v2.x - v0.x) * inv_area;
+	float a2 = (v1.y - v0.y) * inv_area, b2 = (v0.x - v1.x) * inv_area;
+	// evaluated relative to a vertex of each edge at the first pixel center, which keeps the magnitudes small
+	float px = x0 + 0.5f, py = y0 + 0.5f;
+	float c0 = a0 * (px - v1.x) + b0 * (py - v1.y);
+	float c1 = a1 * (px - v2.x) + b1 * (py - v2.y);
+	float c2 = a2 * (px - v0.x) + b2 * (py - v0.y);
+
+	// w save z in world space, 1/z is then linear in screen space
+	float iw0 = 1.f / v[0].w, iw1 = 1.f / v[1].w, iw2 = 1.f / v[2].w;
+	// an affine position_matrix() (orthographic, e.g. a light's) leaves w = 1, the depth is then
+	// the screen space z, which is linear in screen space itself
+	const bool affine = !d.clip_near;
+	float dz[3];
+	const bool linear = corner_depths(v, d, fb, dz);
+	// interpolated z stays between the vertex ones when they are on the same side of the eye
+	bool same_side = (v[0].w < 0) == (v[1].w < 0) && (v[1].w < 0) == (v[2].w < 0);
+	float tri_zmax = linear ? std::max(dz[0], std::max(dz[1], dz[2]))
+					 : same_side ? std::max(v[0].w, std::max(v[1].w, v[2].w)) : std::numeric_limits<float>::max();
+	gradient_t grad;
+	if (!ShaderT::depth_only) grad.setup(v, t.clipped ? t.bc : NULL);
+	const vfloat z0(dz[0]), z1(dz[1]), z2(dz[2]);
+	float *zf = fb.depth_f32();
+
+	const vfloat w0(iw0), w1(iw1), w2(iw2);
+	const vfloat ramp = vfloat::ramp();
+	const vfloat step0(a0 * SIMD_WIDTH), step1(a1 * SIMD_WIDTH), step2(a2 * SIMD_WIDTH);
+	float bx[SIMD_WIDTH], by[SIMD_WIDTH], bz[SIMD_WIDTH], zs[SIMD_WIDTH], ws[SIMD_WIDTH];
+	const float *depth = linear ? zs : ws;	// what the depth test sees
+	bool varyings = false;
+
+    Vec3f color;
+	for (int blk_y = y0 - y0 % HIZ_BLOCK; blk_y <= y1; blk_y += HIZ_BLOCK)
+		for (int blk_x = x0 - x0 % HIZ_BLOCK; blk_x <= x1; blk_x += HIZ_BLOCK) {
+			int bx0 = std::max(blk_x, x0), bx1 = std::min(blk_x + HIZ_BLOCK - 1, x1);
+			int by0 = std::max(blk_y, y0), by1 = std::min(blk_y + HIZ_BLOCK - 1, y1);
+			float dx = (float)(bx0 - x0), dy = (float)(by0 - y0);
+			float sx = (float)(bx1 - bx0), sy = (float)(by1 - by0);
+			float r0 = c0 + a0 * dx + b0 * dy;
+			float r1 = c1 + a1 * dx + b1 * dy;
+			float r2 = c2 + a2 * dx + b2 * dy;
+			// an edge that is negative at all four corners leaves the whole block uncovered
+			if (r0 + std::max(0.f, a0 * sx) + std::max(0.f, b0 * sy) < 0.f ||
+				r1 + std::max(0.f, a1 * sx) + std::max(0.f, b1 * sy) < 0.f ||
+				r2 + std::max(0.f, a2 * sx) + std::max(0.f, b2 * sy) < 0.f) continue;
+
+			float *hiz = &hiz_[blk_x / HIZ_BLOCK + (blk_y / HIZ_BLOCK) * hiz_width];
+			if (early_z) {
+				// closest z the triangle can reach in the block, from 1/z at the block corners
+				float zmax = tri_zmax;
+				if (same_side && !linear) {
+					float q[4];
+					q[0] = r0 * iw0 + r1 * iw1 + r2 * iw2;
+					q[1] = q[0] + (a0 * iw0 + a1 * iw1 + a2 * iw2) * sx;
+					q[2] = q[0] + (b0 * iw0 + b1 * iw1 + b2 * iw2) * sy;
+					q[3] = q[1] + q[2] - q[0];
+					bool ok = true;
+					float zc = -std::numeric_limits<float>::max();
+					for (int i = 0; i < 4; i++) {
+						ok = ok && (q[i] < 0) == (v[0].w < 0) && q[i] != 0.f;
+						zc = std::max(zc, 1.f / q[i]);
+					}
+					if (ok) zmax = std::min(zmax, zc);
+				}
+				if (zmax <= *hiz) continue;	// occluded
+			}
+			fb.prepare(blk_x / HIZ_BLOCK, blk_y / HIZ_BLOCK);	// a cleared block gets its values now
+
+			bool written = false;
+			for (int y = by0; y <= by1; y++, r0 += b0, r1 += b1, r2 += b2) {
+				vfloat e0 = vfloat(r0) + vfloat(a0) * ramp;
+				vfloat e1 = vfloat(r1) + vfloat(a1) * ramp;
+				vfloat e2 = vfloat(r2) + vfloat(a2) * ramp;
+				for (int x = bx0; x <= bx1; x += SIMD_WIDTH, e0 = e0 + step0, e1 = e1 + step1, e2 = e2 + step2) {
+					int mask = mask_ge0(e0, e1, e2);
+					if (bx1 - x + 1 < SIMD_WIDTH) mask &= (1 << (bx1 - x + 1)) - 1;
+					if (!mask) continue;
+					if (ShaderT::depth_only) {
+						vfloat z = fb.quantize(linear ? e0 * z0 + e1 * z1 + e2 * z2 : vfloat(1.f) / (e0 * w0 + e1 * w1 + e2 * w2));
+						if (zf && mask == (1 << SIMD_WIDTH) - 1) {
+							float *zb = zf + x + y * width;
+							vmax(vfloat::load(zb), z).store(zb);
+							written = true;
+							continue;
+						}
+						z.store(zs);
+						for (int i = 0; i < SIMD_WIDTH; i++) {
+							int idx = x + i + y * width;
+							if ((mask >> i & 1) && zs[i] > fb.depth(idx)) {
+								fb.set_depth(idx, zs[i]);
+								written = true;
+							}
+						}
+						continue;
+					}
+					// perspective correction
+					vfloat p0 = e0 * w0, p1 = e1 * w1, p2 = e2 * w2;
+					vfloat z = vfloat(1.f) / (p0 + p1 + p2);
+					z.store(ws);
+					if (linear) fb.quantize(e0 * z0 + e1 * z1 + e2 * z2).store(zs);
+					(p0 * z).store(bx);
+					(p1 * z).store(by);
+					(p2 * z).store(bz);
+					if (t.clipped) {
+						// back to barycentrics of the whole face
+						for (int i = 0; i < SIMD_WIDTH; i++) {
+							Vec3f b = t.bc[0] * bx[i] + t.bc[1] * by[i] + t.bc[2] * bz[i];
+							bx[i] = b.x;
+							by[i] = b.y;
+							bz[i] = b.z;
+						}
+					}
+					for (int i = 0; i < SIMD_WIDTH; i++) {
+						if (!(mask >> i & 1)) continue;
+						int idx = x + i + y * width;
+						if (early_z && !(depth[i] > fb.depth(idx))) continue;
+						if (deferred_) {
+							// only remember what is visible, resolve() shades it
+							fb.set_depth(idx, depth[i]);
+							vis_t &vis = vis_[idx];
+							vis.draw = (int)draws_.size() - 1;
+							vis.iface = t.iface;
+							vis.b0 = bx[i];
+							vis.b1 = by[i];
+							written = true;
+							continue;
+						}
+						if (!varyings) {
+							assemble<ShaderT>(d, shader, t.iface);
+							varyings = true;
+						}
+						Vec3f bc(bx[i], by[i], bz[i]);
+						grad.eval(bc, affine ? 1.f : ws[i], shader.bc_dx, shader.bc_dy);
+						color = correction_gamma(shader.fragment(bc)) * 255.f;
+						if (depth[i] > fb.depth(idx)) {
+							fb.set_depth(idx, depth[i]);
+							fb.set_color(idx, color);
+							written = true;
+						}
+					}
+				}
+			}
+			if (early_z && written) update_hiz(blk_x, blk_y, fb);
+		}
+}
+
+template <class ShaderT>
+void Rasterizer::triangle_ms(const triangle_t &t, const draw_t &d, ShaderT &shader, int x0, int y0, int x1, int y1, Framebuffer &fb) {
+	const Vec4f *v = t.v;
+	Vec3f v0 = proj3(v[0]);
+	Vec3f v1 = proj3(v[1]);
+	Vec3f v2 = proj3(v[2]);
+
+	// edges as in triangle()
+	float area = (v2.x - v0.x) * (v1.y - v0.y) - (v2.y - v0.y) * (v1.x - v0.x);
+	if (!(std::fabs(area) > 0.f)) return;
+	float inv_area = 1.f / area;
+	float a0 = (v2.y - v1.y) * inv_area, b0 = (v1.x - v2.x) * inv_area;
+	float a1 = (v0.y - v2.y) * inv_area, b1 = (v2.x - v0.x) * inv_area;
+	float a2 = (v1.y - v0.y) * inv_area, b2 = (v0.x - v1.x) * inv_area;
+	float px = x0 + 0.5f, py = y0 + 0.5f;
+	float c0 = a0 * (px - v1.x) + b0 * (py - v1.y);
+	float c1 = a1 * (px - v2.x) + b1 * (py - v2.y);
+	float c2 = a2 * (px - v0.x) + b2 * (py - v0.y);
+	float iw0 = 1.f / v[0].w, iw1 = 1.f / v[1].w, iw2 = 1.f / v[2].w;
+	const bool affine = !d.clip_near;
+	float dz[3];
+	const bool linear = corner_depths(v, d, fb, dz);
+	bool same_side = (v[0].w < 0) == (v[1].w < 0) && (v[1].w < 0) == (v[2].w < 0);
+	float tri_zmax = linear ? std::max(dz[0], std::max(dz[1], dz[2]))
+					 : same_side ? std::max(v[0].w, std::max(v[1].w, v[2].w)) : std::numeric_limits<float>::max();
+	// samples lie up to half a pixel from the centers the edges are evaluated at
+	float m0 = 0.5f * (std::fabs(a0) + std::fabs(b0));
+	float m1 = 0.5f * (std::fabs(a1) + std::fabs(b1));
+	float m2 = 0.5f * (std::fabs(a2) + std::fabs(b2));
+	gradient_t grad;
+	grad.setup(v, t.clipped ? t.bc : NULL);
+
+	const int ns = d.samples;
+	const vfloat z0(dz[0]), z1(dz[1]), z2(dz[2]);
+	const vfloat w0(iw0), w1(iw1), w2(iw2);
+	const vfloat ramp = vfloat::ramp();
+	const vfloat step0(a0 * SIMD_WIDTH), step1(a1 * SIMD_WIDTH), step2(a2 * SIMD_WIDTH);
+	float ec[3][SIMD_WIDTH];		// edges at the pixel centers
+	float zs[8][SIMD_WIDTH];		// depth per sample
+	int cover[8];					// lanes each sample covers
+	bool varyings = false;
+	const int draw = (int)draws_.size() - 1;
+
+	// where lane i is shaded: at the pixel center when the face covers it, else at sample s,
+	// so it never extrapolates past the face. Barycentrics in the face, and the z for grad.
+	auto shading_point = [&](int i, int s, Vec3f &bc) {
+		float e0 = ec[0][i], e1 = ec[1][i], e2 = ec[2][i];
+		if (e0 < 0.f || e1 < 0.f || e2 < 0.f) {
+			e0 += a0 * sample_dx_[s] + b0 * sample_dy_[s];
+			e1 += a1 * sample_dx_[s] + b1 * sample_dy_[s];
+			e2 += a2 * sample_dx_[s] + b2 * sample_dy_[s];
+		}
+		float p0 = e0 * iw0, p1 = e1 * iw1, p2 = e2 * iw2;
+		float z = 1.f / (p0 + p1 + p2);
+		bc = Vec3f(p0 * z, p1 * z, p2 * z);
+		if (t.clipped) bc = t.bc[0] * bc.x + t.bc[1] * bc.y + t.bc[2] * bc.z;
+		return affine ? 1.f : z;
+	};
+
+	for (int blk_y = y0 - y0 % HIZ_BLOCK; blk_y <= y1; blk_y += HIZ_BLOCK)
+		for (int blk_x = x0 - x0 % HIZ_BLOCK; blk_x <= x1; blk_x += HIZ_BLOCK) {
+			int bx0 = std::max(blk_x, x0), bx1 = std::min(blk_x + HIZ_BLOCK - 1, x1);
+			int by0 = std::max(blk_y, y0), by1 = std::min(blk_y + HIZ_BLOCK - 1, y1);
+			float dx = (float)(bx0 - x0), dy = (float)(by0 - y0);
+			float sx = (float)(bx1 - bx0), sy = (float)(by1 - by0);
+			float r0 = c0 + a0 * dx + b0 * dy;
+			float r1 = c1 + a1 * dx + b1 * dy;
+			float r2 = c2 + a2 * dx + b2 * dy;
+			if (r0 + std::max(0.f, a0 * sx) + std::max(0.f, b0 * sy) + m0 < 0.f ||
+				r1 + std::max(0.f, a1 * sx) + std::max(0.f, b1 * sy) + m1 < 0.f ||
+				r2 + std::max(0.f, a2 * sx) + std::max(0.f, b2 * sy) + m2 < 0.f) continue;
+			if (early_z && tri_zmax <= hiz_[blk_x / HIZ_BLOCK + (blk_y / HIZ_BLOCK) * hiz_width]) continue;
+			fb.prepare(blk_x / HIZ_BLOCK, blk_y / HIZ_BLOCK);
+
+			bool written = false;
+			for (int y = by0; y <= by1; y++, r0 += b0, r1 += b1, r2 += b2) {
+				vfloat e0 = vfloat(r0) + vfloat(a0) * ramp;
+				vfloat e1 = vfloat(r1) + vfloat(a1) * ramp;
+				vfloat e2 = vfloat(r2) + vfloat(a2) * ramp;
+				for (int x = bx0; x <= bx1; x += SIMD_WIDTH, e0 = e0 + step0, e1 = e1 + step1, e2 = e2 + step2) {
+					int lanes = bx1 - x + 1 < SIMD_WIDTH ? (1 << (bx1 - x + 1)) - 1 : (1 << SIMD_WIDTH) - 1;
+					int any = 0;
+					for (int s = 0; s < ns; s++) {
+						vfloat s0 = e0 + vfloat(a0 * sample_dx_[s] + b0 * sample_dy_[s]);
+						vfloat s1 = e1 + vfloat(a1 * sample_dx_[s] + b1 * sample_dy_[s]);
+						vfloat s2 = e2 + vfloat(a2 * sample_dx_[s] + b2 * sample_dy_[s]);
+						cover[s] = mask_ge0(s0, s1, s2) & lanes;
+						if (!cover[s]) continue;
+						any |= cover[s];
+						fb.quantize(linear ? s0 * z0 + s1 * z1 + s2 * z2 : vfloat(1.f) / (s0 * w0 + s1 * w1 + s2 * w2)).store(zs[s]);
+					}
+					if (!any) continue;
+					e0.store(ec[0]);
+					e1.store(ec[1]);
+					e2.store(ec[2]);
+					for (int i = 0; i < SIMD_WIDTH; i++) {
+						if (!(any >> i & 1)) continue;
+						int idx = x + i + y * width;
+						float *sz = &sample_z_[(size_t)idx * ns];
+						int pass = 0;
+						for (int s = 0; s < ns; s++)
+							if ((cover[s] >> i & 1) && zs[s][i] > sz[s]) pass |= 1 << s;
+						if (!pass) continue;
+						written = true;
+						float zmax = fb.depth(idx);
+						int first = 0;
+						while (!(pass >> first & 1)) first++;
+						Vec3f bc;
+						float z = shading_point(i, first, bc);
+						if (deferred_) {
+							// every sample keeps the one shading point, resolve_tile() shades it once
+							for (int s = 0; s < ns; s++) {
+								if (!(pass >> s & 1)) continue;
+								sz[s] = zs[s][i];
+								zmax = std::max(zmax, zs[s][i]);
+								vis_[(size_t)idx * ns + s] = vis_t{draw, t.iface, bc.x, bc.y};
+							}
+							fb.set_depth(idx, zmax);
+							continue;
+						}
+						if (!varyings) {
+							assemble<ShaderT>(d, shader, t.iface);
+							varyings = true;
+						}
+						grad.eval(bc, z, shader.bc_dx, shader.bc_dy);
+						Vec3f color = correction_gamma(shader.fragment(bc)) * 255.f;
+						Vec3f *sc = &sample_color_[(size_t)idx * ns];
+						for (int s = 0; s < ns; s++) {
+							if (!(pass >> s & 1)) continue;
+							sz[s] = zs[s][i];
+							sc[s] = color;
+							zmax = std::max(zmax, zs[s][i]);
+						}
+						fb.set_depth(idx, zmax);
+					}
+				}
+			}
+			if (early_z && written) update_hiz(blk_x, blk_y, sample_z_.data(), ns);
+		}
+}
+
+template <class ShaderT>
+void Rasterizer::draw(ShaderT &shader, Framebuffer &fb) {
+	typedef std::chrono::steady_clock clock;
+	typedef std::chrono::duration<double, std::milli> ms;
+	clock::time_point t0 = clock::now();
+	ThreadPool &pool = *pool_;
+	draw_t *dp = begin_draw(shader, ShaderT::depth_only);
+	if (!dp) return;	// entirely outside the frustum
+	draw_t &d = *dp;
+	d.resolve = &Rasterizer::resolve_tile<ShaderT>;
+	int nverts = shader.payload.obj->nverts();
+	int nfaces = shader.payload.obj->nfaces();
+	int nchunks = (int)tris_.size();
+
+	const int batch = 1024;
+	pool.parallel_for((nverts + batch - 1) / batch, [&](int b, int thread) {
+		transform<ShaderT>(d, thread, b * batch, std::min(nverts, (b + 1) * batch));
+	});
+	clock::time_point t1 = clock::now();
+	pool.parallel_for(nchunks, [&](int chunk, int /*thread*/) {
+		bin(d, chunk, (int)((long long)nfaces * chunk / nchunks), (int)((long long)nfaces * (chunk + 1) / nchunks));
+	});
+	clock::time_point t2 = clock::now();
+	pool.parallel_for(ntiles_x * ntiles_y, [&](int tile, int thread) {
+		d.touched[tile] = raster_tile<ShaderT>(d, thread, tile, fb);
+		if (d.touched[tile] && d.samples > 1) sample_tiles_[tile] = 1;
+	});
+	end_draw();
+	clock::time_point t3 = clock::now();
+	timings.vertex += ms(t1 - t0).count();
+	timings.bin += ms(t2 - t1).count();
+	timings.raster += ms(t3 - t2).count();
+}
+
+// shades the pixels the deferred draw number draw left visible in tile. With MSAA once per
+// pixel and face, into every sample of the pixel the face is visible in.
+template <class ShaderT>
+void Rasterizer::resolve_tile(int draw, int tile, int thread, Framebuffer &fb) {
+	int x0 = (tile % ntiles_x) * tile_size;
+	int y0 = (tile / ntiles_x) * tile_size;
+	int x1 = std::min(x0 + tile_size, width) - 1;
+	int y1 = std::min(y0 + tile_size, height) - 1;
+	const draw_t &d = draws_[draw];
+	ShaderT &shader = *static_cast<ShaderT *>(d.shaders[thread]);
+	int iface = -1;	// face whose varyings shader currently holds
+	Vec4f v[3];
+	gradient_t grad;
+	const int ns = d.samples;
+	for (int y = y0; y <= y1; y++)
+		for (int x = x0; x <= x1; x++)
+		for (int s = 0; s < ns; s++) {
+			vis_t &vis = vis_[(size_t)(x + y * width) * ns + s];
+			if (vis.draw != draw) continue;
+			if (vis.iface != iface) {
+				assemble<ShaderT>(d, shader, vis.iface);
+				iface = vis.iface;
+				for (int j = 0; j < 3; j++) {
+					uint32_t k = d.indices[iface * 3 + j];
+					v[j] = Vec4f(d.screen[0][k], d.screen[1][k], d.screen[2][k], d.screen[3][k]);
+				}
+				grad.setup(v, NULL);
+			}
+			Vec3f bc(vis.b0, vis.b1, 1.f - vis.b0 - vis.b1);
+			grad.eval(bc, bc.x * v[0].w + bc.y * v[1].w + bc.z * v[2].w, shader.bc_dx, shader.bc_dy);
+			Vec3f color = correction_gamma(shader.fragment(bc)) * 255.f;
+			vis.draw = -1;
+			if (ns == 1) {
+				fb.set_color(x + y * width, color);
+				continue;
+			}
+			Vec3f *sc = &sample_color_[(size_t)(x + y * width) * ns];
+			sc[s] = color;
+			for (int k = s + 1; k < ns; k++) {
+				vis_t &other = (&vis)[k - s];
+				if (other.draw == draw && other.iface == iface) {
+					sc[k] = color;
+					other.draw = -1;
+				}
+			}
+		}
+}
+
+#endif //__RASTERIZER_H__
@@ -0,0 +1,138 @@
+#ifndef __RENDER_H__
+#define __RENDER_H__
+
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "geometry.h"
+#include "model.h"
+#include "shader.h"
+#include "transform.h"
+#include "pbrShader.h"
+#include "shadowShader.h"
+#include "framebuffer.h"
+#include "rasterizer.h"
+
+// one image of models drawn with a shader, shared by the renderer and the benchmark
+
+// what one image shows and how, besides the models and the shader
+struct view_t {
+	Vec3f camera;
+	Vec3f light;
+	Vec3f target;
+	float angle;	// of the models around the y axis
+	bool shadows;
+	int samples;	// MSAA samples per pixel, 1 for none
+	Framebuffer::ColorFormat color;
+	Framebuffer::DepthFormat depth;
+};
+
+// rgb32f, rgba8 or rgb10
+inline bool parse_color(const std::string &s, Framebuffer::ColorFormat &color) {
+	if (s == "rgb32f") color = Framebuffer::RGB32F;
+	else if (s == "rgba8") color = Framebuffer::RGBA8;
+	else if (s == "rgb10") color = Framebuffer::RGB10A2;
+	else return false;
+	return true;
+}
+
+// 32f, 24 or 16
+inline bool parse_depth(const std::string &s, Framebuffer::DepthFormat &depth) {
+	if (s == "32f") depth = Framebuffer::D32F;
+	else if (s == "24") depth = Framebuffer::D24;
+	else if (s == "16") depth = Framebuffer::D16;
+	else return false;
+	return true;
+}
+
+// p turned by degrees around the y axis through target, the way model() turns the model
+inline Vec3f turn(Vec3f p, Vec3f target, float degrees) {
+	float a = degrees / 180.0 * M_PI;
+	Vec3f d = p - target;
+	return target + Vec3f(cos(a) * d.x + sin(a) * d.z, d.y, -sin(a) * d.x + cos(a) * d.z);
+}
+
+// clears frame, in v's formats, and draws objs into it as v sees them. With v.shadows, for a
+// shader that receives them, the objs are drawn into shadowmap (D32F, the size of frame) from
+// the light first, then the shader looks up what the light reaches. rasterizer has the size of
+// frame as well.
+template <class ShaderT>
+void render(ShaderT &shader, const std::vector<Model*> &objs, const view_t &v, Rasterizer &rasterizer, Framebuffer &frame, Framebuffer &shadowmap) {
+	int w = frame.width(), h = frame.height();
+	float fov = 45;
+	float aspect = (float)w / h;
+	float near = -0.1, far = -50;
+	Vec3f up(0, 1, 0);
+
+	Matrix4f m_projection = projection(fov, aspect, near, far);
+	Matrix4f m_viewport = viewport(w, h);
+	Matrix4f m_view = view(v.camera, up, v.target);
+	Matrix4f m_model = model(v.angle);
+	Matrix4f m_view_light = view(v.light, up, v.target);
+	Matrix4f m_ortho_projection = ortho_projection(-2, 2, -2, 2, near, far);
+	// the light sees the models through a box around their bounds, so the shadow map spends
+	// its texels and depth range on them, whatever their scale
+	float half = 0.f, box_near = -std::numeric_limits<float>::max(), box_far = std::numeric_limits<float>::max();
+	for (auto obj : objs) {
+		Vec3f c = proj3(m_view_light * m_model * proj4(obj->bound_center()));
+		float r = obj->bound_radius();
+		half = std::max(half, std::max(std::fabs(c.x), std::fabs(c.y)) + r);
+		box_near = std::max(box_near, c.z + r);
+		box_far = std::min(box_far, c.z - r);
+	}
+	if (half > 0.f) m_ortho_projection = ortho_projection(-half, half, -half, half, box_near, box_far);
+
+	shader.payload.mvp = m_projection * m_view * m_model;
+	shader.payload.m_model = m_model;
+	shader.payload.m_viewport = m_viewport;
+	shader.payload.m_view = m_view;
+	shader.payload.lightmvp = m_ortho_projection * m_view_light * m_model;
+	shader.payload.light = v.light;
+	shader.payload.target = v.target;
+	shader.payload.camera = v.camera;
+	shader.payload.shadowmap = NULL;
+
+	if (v.shadows && ShaderT::receives_shadows) {
+		shadow_shader depth;
+		depth.payload = shader.payload;
+		shadowmap.clear();
+		for (auto obj : objs) {
+			depth.payload.obj = obj;
+			rasterizer.draw(depth, shadowmap);
+		}
+		shadowmap.fill_cleared();	// read directly
+		shader.payload.shadowmap = shadowmap.depth_f32();
+		shader.payload.shadow_width = w;
+		shader.payload.shadow_height = h;
+	}
+
+	rasterizer.samples = v.samples;
+	frame.set_formats(v.color, v.depth);
+	frame.clear();
+	for (auto obj : objs) {
+		shader.payload.obj = obj;
+		rasterizer.draw(shader, frame);
+	}
+	rasterizer.resolve(frame);
+}
+
+// the names with_shader() knows
+const char *const shader_names[] = {"normal", "phong", "texture", "phong_texture", "bump", "pbr"};
+
+// calls f with a shader of the named type, so the rasterizer is specialized on it.
+// false for an unknown name.
+template <class F>
+bool with_shader(const std::string &name, F f) {
+	if (name == "normal") { normal_shader s; f(s); }
+	else if (name == "phong") { phong_shader s; f(s); }
+	else if (name == "texture") { texture_shader s; f(s); }
+	else if (name == "phong_texture") { phong_texture_shader s; f(s); }
+	else if (name == "bump") { bump_shader s; f(s); }
+	else if (name == "pbr") { pbr_shader s; f(s); }
+	else return false;
+	return true;
+}
+
+#endif //__RENDER_H__
@@ -17,40 +17,140 @@ struct payload_t {
 	Vec3f camera;
 
     Model* obj;
-	Vec3f ndcCoord[3];
+
+	// depth from the light, drawn with shadow_shader (so in m_viewport * lightmvp screen
+	// space, larger is closer), NULL for no shadows
+	const float *shadowmap = NULL;
+	int shadow_width = 0, shadow_height = 0;
+
+	// share of a 3x3 texel neighbourhood of the shadow map around p (m_viewport * lightmvp
+	// screen space) that does not occlude p, 1 outside the map or without one
+	float visibility(const Vec3f &p, float bias) const {
+		if (!shadowmap || !(p.x >= 0.f && p.y >= 0.f && p.x < shadow_width && p.y < shadow_height)) return 1.f;
+		int x = (int)p.x, y = (int)p.y;
+		int lit = 0;
+		for (int j = -1; j <= 1; j++)
+			for (int i = -1; i <= 1; i++) {
+				int sx = std::min(std::max(x + i, 0), shadow_width - 1);
+				int sy = std::min(std::max(y + j, 0), shadow_height - 1);
+				lit += !(shadowmap[sx + sy * shadow_width] > p.z + bias);
+			}
+		return lit / 9.f;
+	}
+
+	// everything that only depends on the fields above, see compile()
+	struct uniform_t {
+		Matrix4f viewport_mvp;		// m_viewport * mvp
+		Matrix4f viewport_lightmvp;	// m_viewport * lightmvp
+		Matrix4f normal_matrix;		// (m_view * m_model)^-T, to view space
+		Vec3f light_dir;			// (light - target).normalize()
+		Vec3f view_dir;				// (camera - target).normalize()
+		Vec3f half_dir;				// (view_dir + light_dir).normalize()
+		float light_r2;				// squared length of light_dir, the Blinn-Phong intensity is divided by it
+		float texel_depth;			// shadow map depth across one texel of a face at 45 degrees to the light
+	} uniform;
+
+	// called by the rasterizer once per draw, so shaders don't redo it per vertex or pixel
+	void compile() {
+		uniform.viewport_mvp = m_viewport * mvp;
+		uniform.viewport_lightmvp = m_viewport * lightmvp;
+		uniform.normal_matrix = (m_view * m_model).inv().transpose();
+		uniform.light_dir = (light - target).normalize();
+		uniform.view_dir = (camera - target).normalize();
+		uniform.half_dir = (uniform.view_dir + uniform.light_dir).normalize();
+		float r = uniform.light_dir.norm();
+		uniform.light_r2 = r * r;
+		const Matrix4f &m = uniform.viewport_lightmvp;
+		Vec3f along_x(m[0][0], m[0][1], m[0][2]), along_z(m[2][0], m[2][1], m[2][2]);
+		uniform.texel_depth = along_z.norm() / along_x.norm();
+	}
 };
 
 struct Shader {
-    virtual ~Shader();
+    // the rasterizer only writes depth for a shader type that sets this: no varyings, no
+    // fragment() calls and no frame
+    static const bool depth_only = false;
+    // whether fragment() looks at payload.shadowmap, so a shadow pass is worth drawing
+    static const bool receives_shadows = false;
+
+    virtual ~Shader() {}
     payload_t payload;
-    virtual Vec4f vertex(int iface, int nthvert) = 0;
+    // screen space derivatives of bc along x and y, set by the rasterizer before each
+    // fragment() call, for texture level of detail
+    Vec3f bc_dx, bc_dy;
+    // screen space positions are position_matrix() * the model positions, the rasterizer
+    // transforms those itself
+    virtual Matrix4f position_matrix() { return payload.uniform.viewport_mvp; }
+    // called by the rasterizer once per draw that survives frustum culling, after
+    // payload.compile(), for the uniforms of one shader type
+    virtual void compile() {}
+    // vertex stage, runs once per unique vertex of payload.obj and writes varying_size() floats
+    virtual int varying_size() = 0;
+    virtual void vertex(int ivert, float *varyings) = 0;
+    // primitive assembly: the varyings vertex() wrote for corner nthvert of the next face
+    virtual void assemble(int nthvert, const float *varyings) = 0;
     virtual Vec3f fragment(Vec3f bc) = 0;
+    virtual Shader *clone() const = 0;    // per-thread copy for the rasterizer workers
+
+    // vertex ivert in the screen space of the shadow map, a varying for shadow()
+    Vec3f light_space(int ivert) {
+        return proj3(payload.uniform.viewport_lightmvp * proj4(payload.obj->vert(ivert)));
+    }
+    // how much light reaches the fragment at bc of the face with shadow map positions ls.
+    // The bias follows the depth slope of the face across the filtered texels, or a face
+    // at a steep angle to the light shadows itself (shadow acne). It stops growing near
+    // grazing angles, where it would let light through thin occluders.
+    float shadow(const Vec3f ls[3], Vec3f bc) const {
+        if (!payload.shadowmap) return 1.f;
+        Vec3f e1 = ls[1] - ls[0], e2 = ls[2] - ls[0];
+        Vec3f n = cross(e1, e2);
+        float k = payload.uniform.texel_depth;
+        float slope = std::abs(n.z) > 1e-6f ? (std::abs(n.x) + std::abs(n.y)) / std::abs(n.z) : 1e6f;
+        float bias = k * 0.5f + std::min(1.5f * slope, 8.f * k);
+        return payload.visibility(ls[0] * bc.x + ls[1] * bc.y + ls[2] * bc.z, bias);
+    }
 };
 
-Shader::~Shader() {}
+struct normal_shader final : public Shader {
+    Vec3f n[3]; // *n is wrong!
 
-struct normal_shader : public Shader {
-    Vec4f n[3]; // *n is wrong!
+    struct varying_t { Vec3f n; };
 
-    virtual Vec4f vertex(int iface, int nthvert) {
-        Vec4f v = payload.m_viewport * payload.mvp * proj4(payload.obj->vert(iface, nthvert));
-        n[nthvert] = (payload.m_view * payload.m_model).inv().transpose() * proj4((payload.obj->normal(iface, nthvert))); // view space
-        return v;
+    virtual Shader *clone() const { return new normal_shader(*this); }
+
+    virtual int varying_size() { return sizeof(varying_t) / sizeof(float); }
+    virtual void vertex(int ivert, float *varyings) {
+        varying_t &out = *(varying_t *)varyings;
+        out.n = proj3(payload.uniform.normal_matrix * proj4(payload.obj->normal(ivert))).normalize(); // view space
+    }
+    virtual void assemble(int nthvert, const float *varyings) {
+        n[nthvert] = ((const varying_t *)varyings)->n;
     }
     virtual Vec3f fragment(Vec3f bc) {
-        Vec3f color = proj3(n[0]).normalize() * bc.x + proj3(n[1]).normalize() * bc.y + proj3(n[2]).normalize() * bc.z;
+        Vec3f color = n[0] * bc.x + n[1] * bc.y + n[2] * bc.z;
         color = (color + Vec3f(1, 1, 1)) / 2.f;
         return color;
     }
 };
 
-struct phong_shader : public Shader {
-	Vec4f n[3]; 
+struct phong_shader final : public Shader {
+	static const bool receives_shadows = true;
+	Vec3f n[3];
+	Vec3f ls[3];
+
+	struct varying_t { Vec3f n; Vec3f ls; };
 
-	virtual Vec4f vertex(int iface, int nthvert) {
-		Vec4f v = payload.m_viewport * payload.mvp * proj4(payload.obj->vert(iface, nthvert));
-		n[nthvert] = (payload.m_view * payload.m_model).inv().transpose() * proj4((payload.obj->normal(iface, nthvert))); // view space
-        return v;
+	virtual Shader *clone() const { return new phong_shader(*this); }
+
+	virtual int varying_size() { return sizeof(varying_t) / sizeof(float); }
+	virtual void vertex(int ivert, float *varyings) {
+		varying_t &out = *(varying_t *)varyings;
+		out.n = proj3(payload.uniform.normal_matrix * proj4(payload.obj->normal(ivert))).normalize(); // view space
+		out.ls = light_space(ivert);
+	}
+	virtual void assemble(int nthvert, const float *varyings) {
+		n[nthvert] = ((const varying_t *)varyings)->n;
+		ls[nthvert] = ((const varying_t *)varyings)->ls;
 	}
 	virtual Vec3f fragment(Vec3f bc) {
 		Vec3f ka(0.005, 0.005, 0.005);
@@ -60,27 +160,33 @@ struct phong_shader : public Shader {
 		Vec3f I(500, 500, 500);
 		int p = 20;
 
-		Vec3f l = (payload.light - payload.target).normalize();
-		Vec3f v = (payload.camera - payload.target).normalize();
-		float r = l.norm();
-		Vec3f nn = (proj3(n[0]).normalize() * bc.x + proj3(n[1]).normalize() * bc.y + proj3(n[2]).normalize() * bc.z).normalize();
-		Vec3f h = (v + l).normalize();
+		Vec3f l = payload.uniform.light_dir;
+		Vec3f nn = (n[0] * bc.x + n[1] * bc.y + n[2] * bc.z).normalize();
+		Vec3f h = payload.uniform.half_dir;
 
 		Vec3f ambient = ka * Ia;
-		Vec3f diffuse = I / (r * r) * std::max(0.f, dot(nn, l)) * kd;
-		Vec3f specular = I / (r * r) * std::pow(std::max(0.f, dot(nn, h)), p);
+		Vec3f diffuse = I / payload.uniform.light_r2 * std::max(0.f, dot(nn, l)) * kd;
+		Vec3f specular = I / payload.uniform.light_r2 * std::pow(std::max(0.f, dot(nn, h)), p);
+		float lit = shadow(ls, bc);
 
-		return ambient + diffuse + specular;
+		return ambient + (diffuse + specular) * lit;
 	}
 };
 
-struct texture_shader : public Shader {
+struct texture_shader final : public Shader {
 	Vec2f uv[3];
 
-	virtual Vec4f vertex(int iface, int nthvert) {
-		Vec4f v = payload.m_viewport * payload.mvp * proj4(payload.obj->vert(iface, nthvert));
-		uv[nthvert] = payload.obj->uv(iface, nthvert);
-		return v;
+	struct varying_t { Vec2f uv; };
+
+	virtual Shader *clone() const { return new texture_shader(*this); }
+
+	virtual int varying_size() { return sizeof(varying_t) / sizeof(float); }
+	virtual void vertex(int ivert, float *varyings) {
+		varying_t &out = *(varying_t *)varyings;
+		out.uv = payload.obj->uv(ivert);
+	}
+	virtual void assemble(int nthvert, const float *varyings) {
+		uv[nthvert] = ((const varying_t *)varyings)->uv;
 	}
 	virtual Vec3f fragment(Vec3f bc) {
 		float u = 0., v = 0.;
@@ -90,21 +196,35 @@ struct texture_shader : public Shader {
 		}
 		//std::cout << u << ";" << v << std::endl;
 		Vec2f uvf(u, v);
-		Vec3f color = payload.obj->diffuse(uvf);
+		Vec2f duvdx = uv[0] * bc_dx.x + uv[1] * bc_dx.y + uv[2] * bc_dx.z;
+		Vec2f duvdy = uv[0] * bc_dy.x + uv[1] * bc_dy.y + uv[2] * bc_dy.z;
+		Vec3f color = payload.obj->diffuse(uvf, duvdx, duvdy);
 		return color;
 	}
 };
 
-struct phong_texture_shader : public Shader {
-	Vec4f n[3]; 
+struct phong_texture_shader final : public Shader {
+	static const bool receives_shadows = true;
+	Vec3f n[3];
 	Vec2f uv[3];
+	Vec3f ls[3];
+
+	struct varying_t { Vec3f n; Vec2f uv; Vec3f ls; };
+
+	virtual Shader *clone() const { return new phong_texture_shader(*this); }
 
-	virtual Vec4f vertex(int iface, int nthvert) {
-		Vec4f v = payload.m_viewport * payload.mvp * proj4(payload.obj->vert(iface, nthvert));
-		n[nthvert] = (payload.m_view * payload.m_model).inv().transpose() * proj4((payload.obj->normal(iface, nthvert))); // view space
-		uv[nthvert] = payload.obj->uv(iface, nthvert);
-		payload.ndcCoord[nthvert] = proj3(payload.mvp * proj4(payload.obj->vert(iface, nthvert)));
-        return v;
+	virtual int varying_size() { return sizeof(varying_t) / sizeof(float); }
+	virtual void vertex(int ivert, float *varyings) {
+		varying_t &out = *(varying_t *)varyings;
+		out.n = proj3(payload.uniform.normal_matrix * proj4(payload.obj->normal(ivert))).normalize(); // view space
+		out.uv = payload.obj->uv(ivert);
+		out.ls = light_space(ivert);
+	}
+	virtual void assemble(int nthvert, const float *varyings) {
+		const varying_t &in = *(const varying_t *)varyings;
+		n[nthvert] = in.n;
+		uv[nthvert] = in.uv;
+		ls[nthvert] = in.ls;
 	}
 	virtual Vec3f fragment(Vec3f bc) {
 		float u = 0., v = 0.;
@@ -113,7 +233,9 @@ struct phong_texture_shader : public Shader {
 			v += uv[i].y * bc[i];
 		}
 		Vec2f uvf(u, v);
-		Vec3f color = payload.obj->diffuse(uvf);
+		Vec2f duvdx = uv[0] * bc_dx.x + uv[1] * bc_dx.y + uv[2] * bc_dx.z;
+		Vec2f duvdy = uv[0] * bc_dy.x + uv[1] * bc_dy.y + uv[2] * bc_dy.z;
+		Vec3f color = payload.obj->diffuse(uvf, duvdx, duvdy);
 
 		Vec3f ka(0.005, 0.005, 0.005);
 		Vec3f kd = color / 255.f;
@@ -122,17 +244,16 @@ struct phong_texture_shader : public Shader {
 		Vec3f I(500, 500, 500);
 		int p = 5000000000000;
 
-		Vec3f l = (payload.light - payload.target).normalize();
-		Vec3f vw = (payload.camera - payload.target).normalize();
-		float r = l.norm();
-		Vec3f nn = (proj3(n[0]).normalize() * bc.x + proj3(n[1]).normalize() * bc.y + proj3(n[2]).normalize() * bc.z).normalize();
-		Vec3f h = (vw + l).normalize();
+		Vec3f l = payload.uniform.light_dir;
+		Vec3f nn = (n[0] * bc.x + n[1] * bc.y + n[2] * bc.z).normalize();
+		Vec3f h = payload.uniform.half_dir;
 
 		Vec3f ambient = ka * Ia;
-		Vec3f diffuse = I / (r * r) * std::max(0.f, dot(nn, l)) * kd;
-		Vec3f specular = I / (r * r) * std::pow(std::max(0.f, dot(nn, h)), p) * ks;
+		Vec3f diffuse = I / payload.uniform.light_r2 * std::max(0.f, dot(nn, l)) * kd;
+		Vec3f specular = I / payload.uniform.light_r2 * std::pow(std::max(0.f, dot(nn, h)), p) * ks;
+		float lit = shadow(ls, bc);
 
-		color = ambient + diffuse + specular;
+		color = ambient + (diffuse + specular) * lit;
 
 		return color;
 	}
@@ -153,22 +274,41 @@ struct phong_texture_shader : public Shader {
 //    }
 //};
 
-struct bump_shader : public Shader {
-	Vec4f n[3];
+struct bump_shader final : public Shader {
+	static const bool receives_shadows = true;
+	Vec3f n[3];
 	Vec2f uv[3];
+	Vec3f ls[3];
+	Vec2f texel;	// one diffuse map texel
+
+	struct varying_t { Vec3f n; Vec2f uv; Vec3f ls; };
+
+    virtual Shader *clone() const { return new bump_shader(*this); }
 
-    virtual Vec4f vertex(int iface, int nthvert) {
-        Vec4f v = payload.m_viewport * payload.mvp * proj4(payload.obj->vert(iface, nthvert));
-		n[nthvert] = (payload.m_view * payload.m_model).inv().transpose() * proj4((payload.obj->normal(iface, nthvert))); // view space
-        uv[nthvert] = payload.obj->uv(iface, nthvert);
-		// std::cout << v.x << ";" << v.y << ";" << v.z << ";" << v.w << std::endl;
-		return v;
+	// here rather than in payload.compile(), so shaders that never sample the diffuse map
+	// leave a lazily loaded one unloaded
+	virtual void compile() {
+		texel = Vec2f(1.f / payload.obj->get_width_diffuse(), 1.f / payload.obj->get_height_diffuse());
+	}
+
+	virtual int varying_size() { return sizeof(varying_t) / sizeof(float); }
+    virtual void vertex(int ivert, float *varyings) {
+		varying_t &out = *(varying_t *)varyings;
+		out.n = proj3(payload.uniform.normal_matrix * proj4(payload.obj->normal(ivert))).normalize(); // view space
+        out.uv = payload.obj->uv(ivert);
+		out.ls = light_space(ivert);
     }
+	virtual void assemble(int nthvert, const float *varyings) {
+		const varying_t &in = *(const varying_t *)varyings;
+		n[nthvert] = in.n;
+		uv[nthvert] = in.uv;
+		ls[nthvert] = in.ls;
+	}
     virtual Vec3f fragment(Vec3f bc) {
 		// n = normal = (x, y, z)
 		// t = (x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z))
 		// b = cross(n, t)
-		Vec3f nn = proj3(n[0]).normalize() * bc.x + proj3(n[1]).normalize() * bc.y + proj3(n[2]).normalize() * bc.z;
+		Vec3f nn = n[0] * bc.x + n[1] * bc.y + n[2] * bc.z;
 		float x = nn.x, y = nn.y, z = nn.z;
 		Vec3f t(x * y / sqrt(x * x + z * z), sqrt(x * x + z * z), z * y / sqrt(x * x + z * z));
 		Vec3f b = cross(nn, t);
@@ -178,15 +318,17 @@ struct bump_shader : public Shader {
 			u += uv[i].x * bc[i];
 			v += uv[i].y * bc[i];
 		}
-		float width = payload.obj->get_width_diffuse(), height = payload.obj->get_height_diffuse();
-		float dpu = c1 *(payload.obj->diffuse(Vec2f(u + 1.f / width, v)).norm() - payload.obj->diffuse(Vec2f(u, v)).norm());
-        float dpv = c2 * (payload.obj->diffuse(Vec2f(u, v + 1.f / height)).norm() - payload.obj->diffuse(Vec2f(u, v)).norm());
+		Vec2f duvdx = uv[0] * bc_dx.x + uv[1] * bc_dx.y + uv[2] * bc_dx.z;
+		Vec2f duvdy = uv[0] * bc_dy.x + uv[1] * bc_dy.y + uv[2] * bc_dy.z;
+		Vec3f tex_color = payload.obj->diffuse(Vec2f(u, v), duvdx, duvdy);
+		float height = tex_color.norm();
+		float dpu = c1 * (payload.obj->diffuse(Vec2f(u + texel.x, v), duvdx, duvdy).norm() - height);
+        float dpv = c2 * (payload.obj->diffuse(Vec2f(u, v + texel.y), duvdx, duvdy).norm() - height);
 		Vec3f normal = Vec3f(-dpu, -dpv, 1.f);
 		Matrix3f TBN(t.x, b.x, nn.x,
 					 t.y, b.y, nn.y,
 					 t.z, b.z, nn.z);
 		Vec3f nl = (TBN * normal).normalize();
-		Vec3f tex_color = payload.obj->diffuse(Vec2f(u, v));
 
 		Vec3f ka(0.005, 0.005, 0.005);
 		Vec3f kd = tex_color / 255.f;
@@ -195,17 +337,16 @@ struct bump_shader : public Shader {
 		Vec3f I(500, 500, 500);
 		int p = 500;
 
-		Vec3f l = (payload.light - payload.target).normalize();
-		Vec3f vw = (payload.camera - payload.target).normalize();
-		float r = l.norm();
-		Vec3f h = (vw + l).normalize();
+		Vec3f l = payload.uniform.light_dir;
+		Vec3f h = payload.uniform.half_dir;
 
 		Vec3f ambient = ka * Ia;
-		Vec3f diffuse = I / (r * r) * std::max(0.f, dot(nl, l)) * kd;
-		Vec3f specular = I / (r * r) * std::pow(std::max(0.f, dot(nl, h)), p) * ks;
+		Vec3f diffuse = I / payload.uniform.light_r2 * std::max(0.f, dot(nl, l)) * kd;
+		Vec3f specular = I / payload.uniform.light_r2 * std::pow(std::max(0.f, dot(nl, h)), p) * ks;
+		float lit = shadow(ls, bc);
 
 		// Vec3f color = (color + Vec3f(1, 1, 1)) / 2.f * tex_color * 255.f;
-		Vec3f color = ambient + diffuse + specular;
+		Vec3f color = ambient + (diffuse + specular) * lit;
 		return color;
     }
 };
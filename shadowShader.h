@@ -1,22 +1,16 @@
-// to do
 #include "shader.h"
 
-struct shadow_shader : public Shader {
-    float depth[3];
+// first pass of shadow mapping: depth as the light sees it, into the buffer the other
+// shaders find in payload.shadowmap. Positions go through viewport_lightmvp, so the map has
+// the size of the framebuffer it is drawn with.
+struct shadow_shader final : public Shader {
+    static const bool depth_only = true;
 
-    virtual Vec4f vertex(int iface, int nthvert) {
-        Vec4f v = payload.m_viewport * payload.lightmvp * proj4(payload.obj->vert(iface, nthvert));
-        //std::cout << v.x << ";" << v.y << ";" << v.z << ";" << v.w << std::endl;
-        depth[nthvert] = proj3(v).z;
-        //std::cout << depth[nthvert] << std::endl;
-        return v;
-    }
-    virtual Vec3f fragment(Vec3f bc) {
-        float dpt = depth[0] * bc.x + depth[1] * bc.y + depth[2] * bc.z;
-        Vec3f color(1.0, 1.0, dpt);
-        //std::cout << dpt << std::endl;
-        //Vec4f fragColor = pack(dpt);
-        //color = (color + Vec3f(1, 1, 1)) / 2.f;
-        return color;
-    }
-};
\ No newline at end of file
+    virtual Shader *clone() const { return new shadow_shader(*this); }
+
+    virtual Matrix4f position_matrix() { return payload.uniform.viewport_lightmvp; }
+    virtual int varying_size() { return 0; }
+    virtual void vertex(int /*ivert*/, float * /*varyings*/) {}
+    virtual void assemble(int /*nthvert*/, const float * /*varyings*/) {}
+    virtual Vec3f fragment(Vec3f /*bc*/) { return Vec3f(); }
+};
@@ -0,0 +1,121 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+// thin wrapper over the widest float vector the build targets:
+// 8 lanes with AVX2, 4 lanes with SSE2, plain floats otherwise
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
+#if SIMD_WIDTH == 8
+
+struct vfloat {
+    __m256 v;
+
+    vfloat() {}
+    vfloat(__m256 v_) : v(v_) {}
+    vfloat(float a) : v(_mm256_set1_ps(a)) {}
+
+    static vfloat ramp() { return _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f); }
+    static vfloat load(const float *p) { return _mm256_loadu_ps(p); }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+    vfloat operator + (const vfloat &b) const { return _mm256_add_ps(v, b.v); }
+    vfloat operator - (const vfloat &b) const { return _mm256_sub_ps(v, b.v); }
+    vfloat operator * (const vfloat &b) const { return _mm256_mul_ps(v, b.v); }
+    vfloat operator / (const vfloat &b) const { return _mm256_div_ps(v, b.v); }
+};
+
+inline vfloat vmin(const vfloat &a, const vfloat &b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat vmax(const vfloat &a, const vfloat &b) { return _mm256_max_ps(a.v, b.v); }
+// lanes rounded toward zero
+inline vfloat vtrunc(const vfloat &a) { return _mm256_round_ps(a.v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+// bit i is set when lane i of all three is >= 0
+inline int mask_ge0(const vfloat &a, const vfloat &b, const vfloat &c) {
+    __m256 zero = _mm256_setzero_ps();
+    __m256 m = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(a.v, zero, _CMP_GE_OQ), _mm256_cmp_ps(b.v, zero, _CMP_GE_OQ)),
+                             _mm256_cmp_ps(c.v, zero, _CMP_GE_OQ));
+    return _mm256_movemask_ps(m);
+}
+// lanes truncated to bytes, they must be in [0, 255]
+inline void store_u8(const vfloat &a, unsigned char *p) {
+    __m256i i = _mm256_cvttps_epi32(a.v);
+    __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1));
+    _mm_storel_epi64((__m128i *)p, _mm_packus_epi16(w, w));
+}
+
+#elif SIMD_WIDTH == 4
+
+struct vfloat {
+    __m128 v;
+
+    vfloat() {}
+    vfloat(__m128 v_) : v(v_) {}
+    vfloat(float a) : v(_mm_set1_ps(a)) {}
+
+    static vfloat ramp() { return _mm_setr_ps(0.f, 1.f, 2.f, 3.f); }
+    static vfloat load(const float *p) { return _mm_loadu_ps(p); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+
+    vfloat operator + (const vfloat &b) const { return _mm_add_ps(v, b.v); }
+    vfloat operator - (const vfloat &b) const { return _mm_sub_ps(v, b.v); }
+    vfloat operator * (const vfloat &b) const { return _mm_mul_ps(v, b.v); }
+    vfloat operator / (const vfloat &b) const { return _mm_div_ps(v, b.v); }
+};
+
+inline vfloat vmin(const vfloat &a, const vfloat &b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat vmax(const vfloat &a, const vfloat &b) { return _mm_max_ps(a.v, b.v); }
+// through int, the lanes must fit one
+inline vfloat vtrunc(const vfloat &a) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v)); }
+inline int mask_ge0(const vfloat &a, const vfloat &b, const vfloat &c) {
+    __m128 zero = _mm_setzero_ps();
+    __m128 m = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(a.v, zero), _mm_cmpge_ps(b.v, zero)), _mm_cmpge_ps(c.v, zero));
+    return _mm_movemask_ps(m);
+}
+inline void store_u8(const vfloat &a, unsigned char *p) {
+    __m128i i = _mm_cvttps_epi32(a.v);
+    __m128i w = _mm_packs_epi32(i, i);
+    int b = _mm_cvtsi128_si32(_mm_packus_epi16(w, w));
+    memcpy(p, &b, 4);
+}
+
+#else
+
+struct vfloat {
+    float v;
+
+    vfloat() {}
+    vfloat(float a) : v(a) {}
+
+    static vfloat ramp() { return vfloat(0.f); }
+    static vfloat load(const float *p) { return vfloat(*p); }
+    void store(float *p) const { *p = v; }
+
+    vfloat operator + (const vfloat &b) const { return v + b.v; }
+    vfloat operator - (const vfloat &b) const { return v - b.v; }
+    vfloat operator * (const vfloat &b) const { return v * b.v; }
+    vfloat operator / (const vfloat &b) const { return v / b.v; }
+};
+
+inline vfloat vmin(const vfloat &a, const vfloat &b) { return a.v < b.v ? a : b; }
+inline vfloat vmax(const vfloat &a, const vfloat &b) { return a.v > b.v ? a : b; }
+inline vfloat vtrunc(const vfloat &a) { return (float)(int)a.v; }
+inline int mask_ge0(const vfloat &a, const vfloat &b, const vfloat &c) {
+    return a.v >= 0.f && b.v >= 0.f && c.v >= 0.f;
+}
+inline void store_u8(const vfloat &a, unsigned char *p) {
+    *p = (unsigned char)(int)a.v;
+}
+
+#endif
+
+#endif //__SIMD_H__
@@ -0,0 +1,134 @@
+#include <cmath>
+#include <algorithm>
+#include "texture.h"
+
+namespace {
+// i / 255.f, the same values the TGAColor conversion gave
+struct unorm8_table {
+    float v[256];
+    unorm8_table() {
+        for (int i = 0; i < 256; i++) v[i] = i / 255.f;
+    }
+};
+const unorm8_table unorm8;
+
+uint32_t pack(unsigned r, unsigned g, unsigned b, unsigned a) {
+    return r | g << 8 | b << 16 | a << 24;
+}
+}
+
+Texture::Texture() : levels_() {}
+
+void Texture::build(TGAImage &img) {
+    levels_.clear();
+    if (!img.buffer() || img.get_width() <= 0 || img.get_height() <= 0) return;
+    for (int w = img.get_width(), h = img.get_height();; w = std::max(1, w / 2), h = std::max(1, h / 2)) {
+        levels_.push_back(level_t());
+        level_t &l = levels_.back();
+        l.width = w;
+        l.height = h;
+        l.tiles_x = (w + TILE - 1) / TILE;
+        l.texels.resize((size_t)l.tiles_x * ((h + TILE - 1) / TILE) * TILE * TILE);
+        if (w == 1 && h == 1) break;
+    }
+
+    // level 0: decoded from BGR(A) or gray
+    level_t &base = levels_[0];
+    const unsigned char *p = img.buffer();
+    int bpp = img.get_bytespp();
+    for (int y = 0; y < base.height; y++) {
+        if (bpp == 1) {
+            for (int x = 0; x < base.width; x++, p++) base.at(x, y) = pack(p[0], p[0], p[0], 255);
+        } else if (bpp == 3) {
+            for (int x = 0; x < base.width; x++, p += 3) base.at(x, y) = pack(p[2], p[1], p[0], 255);
+        } else {
+            for (int x = 0; x < base.width; x++, p += 4) base.at(x, y) = pack(p[2], p[1], p[0], p[3]);
+        }
+    }
+
+    for (size_t i = 1; i < levels_.size(); i++) {
+        level_t &s = levels_[i - 1], &d = levels_[i];
+        for (int y = 0; y < d.height; y++) {
+            int y0 = std::min(2 * y, s.height - 1), y1 = std::min(2 * y + 1, s.height - 1);
+            for (int x = 0; x < d.width; x++) {
+                int x0 = std::min(2 * x, s.width - 1), x1 = std::min(2 * x + 1, s.width - 1);
+                uint32_t a = s.at(x0, y0), b = s.at(x1, y0), c = s.at(x0, y1), e = s.at(x1, y1);
+                // rounded average of the four per channel, two channels at a time in 16 bit lanes
+                const uint32_t m = 0x00ff00ff;
+                uint32_t lo = (a & m) + (b & m) + (c & m) + (e & m) + 0x00020002;
+                uint32_t hi = (a >> 8 & m) + (b >> 8 & m) + (c >> 8 & m) + (e >> 8 & m) + 0x00020002;
+                d.at(x, y) = (lo >> 2 & m) | (hi >> 2 & m) << 8;
+            }
+        }
+    }
+}
+
+bool Texture::empty() {
+    return levels_.empty();
+}
+
+int Texture::get_width() {
+    return levels_.empty() ? 0 : levels_[0].width;
+}
+
+int Texture::get_height() {
+    return levels_.empty() ? 0 : levels_[0].height;
+}
+
+int Texture::nlevels() {
+    return (int)levels_.size();
+}
+
+size_t Texture::bytes() {
+    size_t n = sizeof(*this);
+    for (auto &l : levels_) n += sizeof(l) + l.texels.size() * sizeof(uint32_t);
+    return n;
+}
+
+Vec4f Texture::unpack(uint32_t c) {
+    return Vec4f(unorm8.v[c & 255], unorm8.v[c >> 8 & 255], unorm8.v[c >> 16 & 255], unorm8.v[c >> 24]);
+}
+
+// texel centers sit at half integers, clamped to the edge
+Vec4f Texture::bilinear(int level, float u, float v) {
+    level_t &l = levels_[level];
+    float x = u * l.width - 0.5f, y = v * l.height - 0.5f;
+    float fx = std::floor(x), fy = std::floor(y);
+    float s = x - fx, t = y - fy;
+    // clamped in float first, so far out uvs can't overflow the int conversion
+    fx = std::min(std::max(fx, -1.f), (float)l.width);
+    fy = std::min(std::max(fy, -1.f), (float)l.height);
+    int x0 = (int)fx, y0 = (int)fy;
+    int x1 = std::min(x0 + 1, l.width - 1), y1 = std::min(y0 + 1, l.height - 1);
+    x0 = std::min(std::max(x0, 0), l.width - 1);
+    y0 = std::min(std::max(y0, 0), l.height - 1);
+    Vec4f a = unpack(l.at(x0, y0)), b = unpack(l.at(x1, y0));
+    Vec4f c = unpack(l.at(x0, y1)), d = unpack(l.at(x1, y1));
+    Vec4f top = a + (b - a) * s, bottom = c + (d - c) * s;
+    return top + (bottom - top) * t;
+}
+
+Vec4f Texture::sample(Vec2f uv) {
+    if (levels_.empty()) return Vec4f(0, 0, 0, 0);
+    level_t &l = levels_[0];
+    Vec2i p(uv.x * l.width, uv.y * l.height);
+    if (p.x < 0 || p.y < 0 || p.x >= l.width || p.y >= l.height) return Vec4f(0, 0, 0, 0);
+    return unpack(l.at(p.x, p.y));
+}
+
+Vec4f Texture::sample(Vec2f uv, Vec2f duvdx, Vec2f duvdy, Filter filter) {
+    if (filter == NEAREST || levels_.empty()) return sample(uv);
+    if (!(uv.x == uv.x && uv.y == uv.y)) return Vec4f(0, 0, 0, 0);   // NaN
+    // level of detail: log2 of the longer pixel footprint in level 0 texels
+    float w = (float)get_width(), h = (float)get_height();
+    float dx2 = duvdx.x * w * duvdx.x * w + duvdx.y * h * duvdx.y * h;
+    float dy2 = duvdy.x * w * duvdy.x * w + duvdy.y * h * duvdy.y * h;
+    float lod = 0.5f * std::log2(std::max(dx2, dy2));
+    if (!(lod > 0.f)) lod = 0.f;
+    lod = std::min(lod, (float)(levels_.size() - 1));
+    if (filter == BILINEAR) return bilinear((int)(lod + 0.5f), uv.x, uv.y);
+    int l0 = (int)lod, l1 = std::min(l0 + 1, (int)levels_.size() - 1);
+    Vec4f a = bilinear(l0, uv.x, uv.y);
+    if (l1 == l0) return a;
+    return a + (bilinear(l1, uv.x, uv.y) - a) * (lod - l0);
+}
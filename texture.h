@@ -0,0 +1,54 @@
+#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+
+#include <vector>
+#include <cstdint>
+#include "geometry.h"
+#include "tgaimage.h"
+
+// mipmapped texture: level 0 is the image, each next level a 2x2 box filtered half
+// of the previous one, down to 1x1. Colors come back as rgba in [0, 1], grayscale
+// images repeat the gray in r, g and b.
+// Texels are decoded once to RGBA8 and stored in 4x4 tiles, so that a tile fills one
+// 64 byte cache line and a bilinear footprint rarely touches more than one.
+class Texture {
+public:
+    enum Filter {
+        NEAREST,    // level 0 only, as TGAImage::get()
+        BILINEAR,   // nearest level
+        TRILINEAR   // blend of the two nearest levels
+    };
+private:
+    static const int TILE_BITS = 2;     // 4x4 texel tiles
+    static const int TILE = 1 << TILE_BITS;
+
+    struct level_t {
+        int width, height;
+        int tiles_x;                    // tiles per row
+        std::vector<uint32_t> texels;   // r in the low byte, tile after tile
+        // no bounds check, 0 <= x < width and 0 <= y < height
+        uint32_t &at(int x, int y) {
+            return texels[(((y >> TILE_BITS) * tiles_x + (x >> TILE_BITS)) << (2 * TILE_BITS)) + ((y & (TILE - 1)) << TILE_BITS) + (x & (TILE - 1))];
+        }
+    };
+    std::vector<level_t> levels_;
+
+    static Vec4f unpack(uint32_t c);
+    Vec4f bilinear(int level, float u, float v);
+public:
+    Texture();
+    // replaces the pyramid by one built from img
+    void build(TGAImage &img);
+    bool empty();
+    int get_width();
+    int get_height();
+    int nlevels();
+    size_t bytes();     // of all levels
+    // nearest texel of level 0, black outside [0, 1)
+    Vec4f sample(Vec2f uv);
+    // filtered, the level comes from the derivatives of uv along screen x and y. The filter
+    // is an argument rather than state, as one texture can be shared by several models.
+    Vec4f sample(Vec2f uv, Vec2f duvdx, Vec2f duvdy, Filter filter = TRILINEAR);
+};
+
+#endif //__TEXTURE_H__
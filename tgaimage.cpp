@@ -4,7 +4,13 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
 #include "tgaimage.h"
+#include "mappedfile.h"
+#include "threadpool.h"
+#include "simd.h"
 
 #define M_PI 3.14159265358979323846 
 
@@ -39,108 +45,96 @@ TGAImage & TGAImage::operator =(const TGAImage &img) {
     return *this;
 }
 
-bool TGAImage::read_tga_file(const char *filename) {
+bool TGAImage::read_tga_file(const char *filename, bool bottom_up) {
     if (data) delete [] data;
     data = NULL;
-    std::ifstream in;
-    in.open (filename, std::ios::binary);
-    if (!in.is_open()) {
+    // mapped and decoded straight into data, without stream buffering or a second pass to flip
+    MappedFile in;
+    if (!in.open(filename)) {
         std::cerr << "can't open file " << filename << "\n";
-        in.close();
         return false;
     }
     TGA_Header header;
-    in.read((char *)&header, sizeof(header));
-    if (!in.good()) {
-        in.close();
+    if (in.size() < sizeof(header)) {
         std::cerr << "an error occured while reading the header\n";
         return false;
     }
+    memcpy(&header, in.data(), sizeof(header));
     width   = header.width;
     height  = header.height;
     bytespp = header.bitsperpixel>>3;
     if (width<=0 || height<=0 || (bytespp!=GRAYSCALE && bytespp!=RGB && bytespp!=RGBA)) {
-        in.close();
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
-    unsigned long nbytes = bytespp*width*height;
-    data = new unsigned char[nbytes];
+    // pixels follow the image id and the color map
+    size_t offset = sizeof(header) + (unsigned char)header.idlength;
+    if (header.colormaptype) offset += (size_t)(unsigned short)header.colormaplength * (((unsigned char)header.colormapdepth + 7) / 8);
+    const unsigned char *begin = (const unsigned char *)in.data() + std::min(offset, in.size());
+    const unsigned char *end = (const unsigned char *)in.data() + in.size();
+    bool rle;
     if (3==header.datatypecode || 2==header.datatypecode) {
-        in.read((char *)data, nbytes);
-        if (!in.good()) {
-            in.close();
-            std::cerr << "an error occured while reading the data\n";
-            return false;
-        }
+        rle = false;
     } else if (10==header.datatypecode||11==header.datatypecode) {
-        if (!load_rle_data(in)) {
-            in.close();
-            std::cerr << "an error occured while reading the data\n";
-            return false;
-        }
+        rle = true;
     } else {
-        in.close();
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
-    if (!(header.imagedescriptor & 0x20)) {
-        flip_vertically();
+    unsigned long nbytes = bytespp*width*height;
+    data = new unsigned char[nbytes];
+    // rows come bottom to top unless the descriptor says top-left origin
+    bool reverse = !(header.imagedescriptor & 0x20) != bottom_up;
+    if (!load_data(begin, end, rle, reverse)) {
+        std::cerr << "an error occured while reading the data\n";
+        return false;
     }
     if (header.imagedescriptor & 0x10) {
         flip_horizontally();
     }
     std::cerr << width << "x" << height << "/" << bytespp*8 << "\n";
-    in.close();
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream &in) {
+// decodes raw or RLE pixels in file order, row r of the file lands in row r of data,
+// or row height-1-r with reverse. Runs and raw packets are copied a row segment at a time.
+bool TGAImage::load_data(const unsigned char *in, const unsigned char *end, bool rle, bool reverse) {
+    unsigned long bytes_per_line = width*bytespp;
     unsigned long pixelcount = width*height;
     unsigned long currentpixel = 0;
-    unsigned long currentbyte  = 0;
-    TGAColor colorbuffer;
-    do {
-        unsigned char chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
-            std::cerr << "an error occured while reading the data\n";
-            return false;
-        }
-        if (chunkheader<128) {
-            chunkheader++;
-            for (int i=0; i<chunkheader; i++) {
-                in.read((char *)colorbuffer.bgra, bytespp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t=0; t<bytespp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
-        } else {
-            chunkheader -= 127;
-            in.read((char *)colorbuffer.bgra, bytespp);
-            if (!in.good()) {
-                std::cerr << "an error occured while reading the header\n";
+    while (currentpixel < pixelcount) {
+        unsigned long n = pixelcount - currentpixel;   // pixels of the current packet
+        bool run = false;
+        if (rle) {
+            if (in >= end) return false;
+            unsigned char chunkheader = *in++;
+            run = chunkheader >= 128;
+            n = (chunkheader & 127) + 1;
+            if (currentpixel + n > pixelcount) {
+                std::cerr << "Too many pixels read\n";
                 return false;
             }
-            for (int i=0; i<chunkheader; i++) {
-                for (int t=0; t<bytespp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
+        }
+        if ((unsigned long)(end - in) < (run ? 1 : n) * bytespp) return false;
+        const unsigned char *color = in;
+        in += (run ? 1 : n) * bytespp;
+        while (n) {
+            unsigned long row = currentpixel / width, col = currentpixel % width;
+            unsigned long k = std::min(n, width - col);
+            unsigned char *dst = data + (reverse ? height - 1 - row : row) * bytes_per_line + col * bytespp;
+            if (!run) {
+                memcpy(dst, color, k * bytespp);
+                color += k * bytespp;
+            } else if (bytespp == 1) {
+                memset(dst, color[0], k);
+            } else {
+                for (unsigned long i = 0; i < k; i++, dst += bytespp)
+                    memcpy(dst, color, bytespp);
             }
+            currentpixel += k;
+            n -= k;
         }
-    } while (currentpixel < pixelcount);
+    }
     return true;
 }
 
@@ -372,34 +366,168 @@ float* gaussian_kernel(const int radius) {
     return gaussian_kernel;
 }
 
+namespace {
+// a 1D filter from in samples to out samples, clamped at the edges: output i is the sum
+// over k < ntaps of weights[i * ntaps + k] * input[first[i] + k]
+struct taps_t {
+    int ntaps;
+    std::vector<int> first;
+    std::vector<float> weights;
+};
+
+// kernel is zero beyond support, both in output sample spacing. When shrinking it is
+// stretched over the input, so every input sample counts.
+taps_t make_taps(int in, int out, float support, const std::function<float(float)> &kernel) {
+    float ratio = (float)in/out;
+    float stretch = std::max(1.f, ratio);
+    float reach = support*stretch;
+    taps_t t;
+    t.ntaps = std::min(in, (int)std::floor(2.f*reach) + 1);
+    t.first.resize(out);
+    t.weights.assign((size_t)out*t.ntaps, 0.f);
+    for (int i=0; i<out; i++) {
+        float center = (i+.5f)*ratio - .5f;
+        int lo = (int)std::ceil(center-reach), hi = (int)std::floor(center+reach);
+        int first = std::min(std::max(lo, 0), in-t.ntaps);
+        float *w = &t.weights[(size_t)i*t.ntaps];
+        float sum = 0.f;
+        for (int j=lo; j<=hi; j++) {
+            float k = kernel((j-center)/stretch);
+            w[std::min(std::max(j, 0), in-1) - first] += k;    // past the edge counts as the edge
+            sum += k;
+        }
+        if (sum!=0.f) for (int k=0; k<t.ntaps; k++) w[k] /= sum;
+        t.first[i] = first;
+    }
+    return t;
+}
+
+float sinc(float x) {
+    if (x==0.f) return 1.f;
+    x *= (float)M_PI;
+    return std::sin(x)/x;
+}
+
+// dst (w_out x h_out) from src (w_in wide): row() filters a src row into w_out*bpp floats,
+// then the taps of ty run down the columns, a vector of pixels at a time. Strips of dst rows
+// go to the pool, each filters the src rows it needs into a buffer of its own.
+void separable(const unsigned char *src, int w_in, int bpp, const taps_t &ty, unsigned char *dst, int w_out, int h_out,
+               const std::function<void(const unsigned char *, float *, int)> &row) {
+    ThreadPool &pool = ThreadPool::instance();
+    size_t in_line = (size_t)w_in*bpp, out_line = (size_t)w_out*bpp;
+    int strip = std::max(16, std::min(128, h_out/(2*pool.size())));
+    std::vector<std::vector<float> > buffers(pool.size());
+    pool.parallel_for((h_out+strip-1)/strip, [&](int s, int thread) {
+        int y0 = s*strip, y1 = std::min(h_out, y0+strip);
+        int lo = ty.first[y0], hi = ty.first[y1-1] + ty.ntaps;
+        std::vector<float> &buf = buffers[thread];
+        buf.resize((size_t)(hi-lo)*out_line);
+        for (int y=lo; y<hi; y++) row(src + y*in_line, &buf[(size_t)(y-lo)*out_line], thread);
+        const vfloat half(.5f), zero(0.f), top(255.f);
+        for (int y=y0; y<y1; y++) {
+            const float *w = &ty.weights[(size_t)y*ty.ntaps];
+            const float *in = &buf[(size_t)(ty.first[y]-lo)*out_line];
+            unsigned char *out = dst + y*out_line;
+            size_t x = 0;
+            // four vectors at once, so the sums don't wait on each other
+            for (; x+4*SIMD_WIDTH<=out_line; x+=4*SIMD_WIDTH) {
+                vfloat acc[4] = {vfloat(0.f), vfloat(0.f), vfloat(0.f), vfloat(0.f)};
+                for (int k=0; k<ty.ntaps; k++) {
+                    const float *p = in + k*out_line + x;
+                    vfloat wk(w[k]);
+                    for (int j=0; j<4; j++) acc[j] = acc[j] + wk*vfloat::load(p + j*SIMD_WIDTH);
+                }
+                for (int j=0; j<4; j++) store_u8(vmin(vmax(acc[j]+half, zero), top), out + x + j*SIMD_WIDTH);     // rounded
+            }
+            for (; x+SIMD_WIDTH<=out_line; x+=SIMD_WIDTH) {
+                vfloat acc(0.f);
+                for (int k=0; k<ty.ntaps; k++) acc = acc + vfloat(w[k])*vfloat::load(in + k*out_line + x);
+                store_u8(vmin(vmax(acc+half, zero), top), out+x);
+            }
+            for (; x<out_line; x++) {
+                float acc = 0.f;
+                for (int k=0; k<ty.ntaps; k++) acc += w[k]*in[k*out_line + x];
+                out[x] = (unsigned char)std::min(std::max(acc+.5f, 0.f), 255.f);
+            }
+        }
+    });
+}
+}
+
+bool TGAImage::scale(int w, int h, Filter filter) {
+    if (filter==NEAREST) return scale(w, h);
+    if (w<=0 || h<=0 || !data) return false;
+    std::function<float(float)> kernel;
+    float support;
+    if (filter==BOX) {
+        kernel = [](float x) { return x>=-.5f && x<.5f ? 1.f : 0.f; };
+        support = .5f;
+    } else {
+        kernel = [](float x) { return std::fabs(x)<3.f ? sinc(x)*sinc(x/3.f) : 0.f; };
+        support = 3.f;
+    }
+    taps_t tx = make_taps(width, w, support, kernel);
+    taps_t ty = make_taps(height, h, support, kernel);
+    unsigned char *tdata = new unsigned char[(size_t)w*h*bytespp];
+    int bpp = bytespp;
+    separable(data, width, bpp, ty, tdata, w, h, [&](const unsigned char *src, float *dst, int) {
+        for (int i=0; i<w; i++) {
+            const float *wt = &tx.weights[(size_t)i*tx.ntaps];
+            const unsigned char *p = src + tx.first[i]*bpp;
+            for (int d=0; d<bpp; d++) {
+                float acc = 0.f;
+                for (int k=0; k<tx.ntaps; k++) acc += wt[k]*p[k*bpp+d];
+                dst[i*bpp+d] = acc;
+            }
+        }
+    });
+    delete [] data;
+    data = tdata;
+    width = w;
+    height = h;
+    return true;
+}
+
+// separable: along the rows, where the kernel is the same for every pixel and runs over a
+// copy of the row padded with its edge pixels, then down the columns
 void TGAImage::gaussian_blur(const int radius) {
+    if (radius<=0 || !data) return;
     float *kernel = gaussian_kernel(radius);
-    TGAImage tmp(*this);
     int size = (radius*2)+1;
-    for (int j=size; j<get_height(); j++) {
-        for (int i=0; i<get_width(); i++) {
-            float BGRA[4] = {0,0,0,0};
-            for (int k=0; k<size; k++){
-                TGAColor c = get(i, j-size+k);
-                for (int d=0; d<bytespp; d++) BGRA[d] += float(c[d])*kernel[k];
-            }
-            unsigned char cBGRA[4];
-            for (int i=4; i--; cBGRA[i] = (unsigned char)BGRA[i]);
-            tmp.set(i, j, TGAColor(cBGRA, bytespp));
+    taps_t ty = make_taps(height, height, radius, [radius](float x) { return std::exp(-x*x/(2.f*radius*radius)); });
+    int bpp = bytespp, w = width;
+    std::vector<std::vector<float> > pads(ThreadPool::instance().size());
+    unsigned char *tdata = new unsigned char[(size_t)width*height*bytespp];
+    separable(data, width, bpp, ty, tdata, width, height, [&](const unsigned char *src, float *dst, int thread) {
+        std::vector<float> &pad = pads[thread];
+        pad.resize((size_t)(w+2*radius)*bpp);
+        for (int i=-radius; i<w+radius; i++) {
+            const unsigned char *p = src + std::min(std::max(i, 0), w-1)*bpp;
+            for (int d=0; d<bpp; d++) pad[(i+radius)*bpp+d] = p[d];
         }
-    }
-    for (int j=0; j<get_height(); j++) {
-        for (int i=size; i<get_width(); i++) {
-            float BGRA[4] = {0,0,0,0};
-            for (int k=0; k<size; k++){
-                TGAColor c = tmp.get(i-size+k, j);
-                for (int d=0; d<bytespp; d++) BGRA[d] += float(c[d])*kernel[k];
+        size_t n = (size_t)w*bpp, x = 0;
+        for (; x+4*SIMD_WIDTH<=n; x+=4*SIMD_WIDTH) {
+            vfloat acc[4] = {vfloat(0.f), vfloat(0.f), vfloat(0.f), vfloat(0.f)};
+            for (int k=0; k<size; k++) {
+                const float *p = &pad[x + k*bpp];
+                vfloat wk(kernel[k]);
+                for (int j=0; j<4; j++) acc[j] = acc[j] + wk*vfloat::load(p + j*SIMD_WIDTH);
             }
-            unsigned char cBGRA[4];
-            for (int i=4; i--; cBGRA[i] = (unsigned char)BGRA[i]);
-            set(i, j, TGAColor(cBGRA, bytespp));
+            for (int j=0; j<4; j++) acc[j].store(dst + x + j*SIMD_WIDTH);
         }
-    }
+        for (; x+SIMD_WIDTH<=n; x+=SIMD_WIDTH) {
+            vfloat acc(0.f);
+            for (int k=0; k<size; k++) acc = acc + vfloat(kernel[k])*vfloat::load(&pad[x + k*bpp]);
+            acc.store(dst+x);
+        }
+        for (; x<n; x++) {
+            float acc = 0.f;
+            for (int k=0; k<size; k++) acc += kernel[k]*pad[x + k*bpp];
+            dst[x] = acc;
+        }
+    });
+    delete [] data;
+    data = tdata;
     delete [] kernel;
 }
 
@@ -67,21 +67,30 @@ protected:
     int height;
     int bytespp;
 
-    bool   load_rle_data(std::ifstream &in);
+    bool   load_data(const unsigned char *in, const unsigned char *end, bool rle, bool reverse);
     bool unload_rle_data(std::ofstream &out);
 public:
     enum Format {
         GRAYSCALE=1, RGB=3, RGBA=4
     };
+    // resampling kernels for scale()
+    enum Filter {
+        NEAREST,    // pixel duplication or skipping
+        BOX,        // average of the covered source pixels
+        LANCZOS     // windowed sinc, 3 lobes: sharpest, may ring at hard edges
+    };
 
     TGAImage();
     TGAImage(int w, int h, int bpp);
     TGAImage(const TGAImage &img);
-    bool read_tga_file(const char *filename);
+    // bottom_up puts the last row of the picture first, the way uv coordinates count
+    bool read_tga_file(const char *filename, bool bottom_up=false);
     bool write_tga_file(const char *filename, bool rle=true);
     bool flip_horizontally();
     bool flip_vertically();
     bool scale(int w, int h);
+    // separable, SIMD and on the thread pool, unlike NEAREST which is the one above
+    bool scale(int w, int h, Filter filter);
     TGAColor get(int x, int y);
     bool set(int x, int y, TGAColor &c);
     bool set(int x, int y, const TGAColor &c);
@@ -92,6 +101,7 @@ public:
     int get_bytespp();
     unsigned char *buffer();
     void clear();
+    // separable, SIMD and on the thread pool; edges are extended
     void gaussian_blur(const int radius);
 };
 
@@ -0,0 +1,135 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int nthreads) : workers_(), ranges_(), task_(NULL), next_(0), count_(0), busy_(0), generation_(0), stealing_(false), stop_(false) {
+    if (nthreads <= 0) nthreads = (int)std::thread::hardware_concurrency();
+    if (nthreads <= 0) nthreads = 1;
+    ranges_.reset(new range_t[nthreads]);
+    for (int i = 1; i < nthreads; i++)
+        workers_.push_back(std::thread(&ThreadPool::worker, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto &t : workers_) t.join();
+}
+
+int ThreadPool::size() {
+    return (int)workers_.size() + 1;
+}
+
+ThreadPool &ThreadPool::instance() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::run(const std::function<void(int, int)> &fn, int n, int thread) {
+    for (int i = next_++; i < n; i = next_++)
+        fn(i, thread);
+}
+
+void ThreadPool::run_stealing(const std::function<void(int, int)> &fn, int thread) {
+    range_t &own = ranges_[thread];
+    for (;;) {
+        int i = -1;
+        {
+            std::lock_guard<std::mutex> lock(own.mtx);
+            if (own.begin < own.end) i = own.begin++;
+        }
+        if (i >= 0) {
+            fn(i, thread);
+            continue;
+        }
+        // ranges only ever shrink or move to a thief, so when all are empty nothing is left
+        int victim = -1, most = 0;
+        for (int k = 0; k < size(); k++) {
+            std::lock_guard<std::mutex> lock(ranges_[k].mtx);
+            if (ranges_[k].end - ranges_[k].begin > most) {
+                most = ranges_[k].end - ranges_[k].begin;
+                victim = k;
+            }
+        }
+        if (victim < 0) return;
+        int begin, end;
+        {
+            std::lock_guard<std::mutex> lock(ranges_[victim].mtx);
+            range_t &r = ranges_[victim];
+            int left = r.end - r.begin;
+            if (left <= 0) continue;    // emptied meanwhile, look again
+            end = r.end;
+            begin = r.end -= (left + 1) / 2;
+        }
+        std::lock_guard<std::mutex> lock(own.mtx);
+        own.begin = begin;
+        own.end = end;
+    }
+}
+
+void ThreadPool::worker(int thread) {
+    unsigned long seen = 0;
+    for (;;) {
+        const std::function<void(int, int)> *task;
+        int n;
+        bool stealing;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+            if (stop_) return;
+            seen = generation_;
+            task = task_;
+            n = count_;
+            stealing = stealing_;
+            if (!task) continue;    // woke up after the caller already finished
+            busy_++;
+        }
+        if (stealing) run_stealing(*task, thread);
+        else run(*task, n, thread);
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            busy_--;
+        }
+        done_.notify_all();
+    }
+}
+
+void ThreadPool::parallel_for(int n, const std::function<void(int, int)> &fn) {
+    call(n, fn, false);
+}
+
+void ThreadPool::parallel_for_stealing(int n, const std::function<void(int, int)> &fn) {
+    call(n, fn, true);
+}
+
+void ThreadPool::call(int n, const std::function<void(int, int)> &fn, bool stealing) {
+    if (n <= 0) return;
+    if (workers_.empty() || n == 1) {
+        for (int i = 0; i < n; i++) fn(i, 0);
+        return;
+    }
+    std::lock_guard<std::mutex> serial(call_mtx_);    // one parallel_for at a time
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        task_ = &fn;
+        count_ = n;
+        next_ = 0;
+        stealing_ = stealing;
+        if (stealing) {
+            // no worker is running, see the wait below
+            for (int k = 0; k < size(); k++) {
+                ranges_[k].begin = (int)((long long)n * k / size());
+                ranges_[k].end = (int)((long long)n * (k + 1) / size());
+            }
+        }
+        generation_++;
+    }
+    wake_.notify_all();
+    if (stealing) run_stealing(fn, 0);
+    else run(fn, n, 0);
+    // every index has been handed out, wait for the workers still holding one
+    std::unique_lock<std::mutex> lock(mtx_);
+    done_.wait(lock, [&] { return busy_ == 0; });
+    task_ = NULL;
+}
@@ -0,0 +1,54 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+
+// persistent worker pool, the calling thread takes part as worker 0
+class ThreadPool {
+private:
+    // indices [begin, end) a thread still has to run in parallel_for_stealing()
+    struct range_t {
+        std::mutex mtx;
+        int begin, end;
+    };
+    std::vector<std::thread> workers_;
+    std::unique_ptr<range_t[]> ranges_;     // per thread
+    std::mutex mtx_;
+    std::mutex call_mtx_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(int, int)> *task_;
+    std::atomic<int> next_;
+    int count_;
+    int busy_;
+    unsigned long generation_;
+    bool stealing_;     // the current call is parallel_for_stealing()
+    bool stop_;
+
+    void run(const std::function<void(int, int)> &fn, int n, int thread);
+    void run_stealing(const std::function<void(int, int)> &fn, int thread);
+    void call(int n, const std::function<void(int, int)> &fn, bool stealing);
+    void worker(int thread);
+public:
+    ThreadPool(int nthreads = 0);   // 0 means one per hardware thread
+    ~ThreadPool();
+    int size();
+    // calls fn(i, thread) for every i in [0, n) and returns when all are done,
+    // thread is in [0, size()) and can be used to index per-thread scratch data,
+    // fn must not call parallel_for itself
+    void parallel_for(int n, const std::function<void(int, int)> &fn);
+    // the same, but [0, n) is first cut into one contiguous range per thread and a thread
+    // that runs out of its own steals the back half of the fullest other range. Neighbouring
+    // indices mostly run on one thread, which helps when they share data, and uneven costs
+    // still even out.
+    void parallel_for_stealing(int n, const std::function<void(int, int)> &fn);
+    static ThreadPool &instance();
+};
+
+#endif //__THREADPOOL_H__